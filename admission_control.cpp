@@ -0,0 +1,97 @@
+#include "admission_control.h"
+#include <algorithm>
+#include <string>
+#include <grpcpp/alarm.h>
+
+
+namespace {
+
+const std::chrono::milliseconds kProbeInterval(10);
+
+}
+
+
+// Measures how late its alarm comes out of the completion queue
+class AdmissionControl::LagProbe : public AsyncCallHandler<LagProbe> {
+public:
+
+    LagProbe(AdmissionControl* admission, grpc::ServerCompletionQueue* cq)
+        : admission_(admission), cq_(cq), queue_(admission->AddQueue()), lag_(0) {
+    }
+
+    virtual void Proceed() override {
+
+        auto now = std::chrono::system_clock::now();
+
+        if (deadline_ != std::chrono::system_clock::time_point()) {
+            // Smoothed, a single late wake up should not shed load
+            auto sample = std::chrono::duration_cast<std::chrono::microseconds>(now - deadline_);
+            lag_ = (lag_ * 7 + std::max(sample, std::chrono::microseconds(0))) / 8;
+            admission_->ReportLag(queue_, lag_);
+        }
+
+        deadline_ = now + kProbeInterval;
+        alarm_.Set(cq_, deadline_, Tag());
+    }
+
+private:
+    AdmissionControl* admission_;
+    grpc::ServerCompletionQueue* cq_;
+    grpc::Alarm alarm_;
+    std::chrono::system_clock::time_point deadline_;
+    int queue_;
+    std::chrono::microseconds lag_;
+};
+
+
+bool AdmissionControl::TryAdmit(size_t handlers) {
+
+    bool admit = limits_.maxHandlers == 0 || handlers < limits_.maxHandlers;
+
+    if (admit && limits_.maxEventLag.count() > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto lag : lag_) {
+            admit = admit && lag < limits_.maxEventLag;
+        }
+    }
+
+    if (admit) {
+        int sessions = sessions_.fetch_add(1) + 1;
+        if (limits_.maxSessions > 0 && sessions > limits_.maxSessions) {
+            sessions_.fetch_sub(1);
+            admit = false;
+        }
+    }
+
+    if (!admit) {
+        rejected_.fetch_add(1);
+    }
+    return admit;
+}
+
+void AdmissionControl::Release() {
+    sessions_.fetch_sub(1);
+}
+
+void AdmissionControl::BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq) {
+    if (limits_.maxEventLag.count() > 0) {
+        registry->Register(new LagProbe(this, cq));
+    }
+}
+
+grpc::Status AdmissionControl::Reject(grpc::ServerContextBase* context) {
+    // Honoured by clients with a retry policy, readable by any other
+    context->AddTrailingMetadata("grpc-retry-pushback-ms", std::to_string(limits_.retryAfter.count()));
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "server overloaded, retry later");
+}
+
+int AdmissionControl::AddQueue() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lag_.push_back(std::chrono::microseconds(0));
+    return static_cast<int>(lag_.size()) - 1;
+}
+
+void AdmissionControl::ReportLag(int queue, std::chrono::microseconds lag) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lag_[queue] = lag;
+}
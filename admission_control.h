@@ -0,0 +1,84 @@
+#ifndef SRC_ADMISSION_CONTROL_H_
+#define SRC_ADMISSION_CONTROL_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+#include "async_call_handler.h"
+
+struct AdmissionLimits {
+
+    AdmissionLimits()
+        : maxSessions(0), maxHandlers(0), maxEventLag(0), retryAfter(1000) {
+    }
+
+    int maxSessions;                        // 0: unlimited
+    size_t maxHandlers;                     // per HandlerRegistry, 0: unlimited
+    std::chrono::milliseconds maxEventLag;  // 0: not checked
+    std::chrono::milliseconds retryAfter;   // hint sent with a rejection
+};
+
+// Decides whether a new chat stream is accepted.
+//
+// A stream is rejected while the server is at its session or handler limit,
+// or while its completion queues lag: each queue runs a probe that sets an
+// alarm every few milliseconds and measures how late it is dequeued, which
+// is how long any event waits on a busy queue. Rejected calls finish at once
+// with RESOURCE_EXHAUSTED and grpc-retry-pushback-ms, so the sessions already
+// admitted keep their latency during a spike.
+class AdmissionControl {
+public:
+
+    AdmissionControl()
+        : sessions_(0), rejected_(0) {
+    }
+
+    void SetLimits(const AdmissionLimits& limits) {
+        limits_ = limits;
+    }
+
+    const AdmissionLimits& limits() const {
+        return limits_;
+    }
+
+    // Counts a session unless a limit is hit; an admitted session must be
+    // released once it ends
+    bool TryAdmit(size_t handlers);
+
+    void Release();
+
+    // Adds the lag probe of a completion queue when lag is checked
+    void BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq);
+
+    // Status of a rejected call; adds the retry hint to its trailing metadata
+    grpc::Status Reject(grpc::ServerContextBase* context);
+
+    int sessions() const {
+        return sessions_.load();
+    }
+
+    int64_t rejected() const {
+        return rejected_.load();
+    }
+
+private:
+
+    class LagProbe;
+
+    int AddQueue();
+
+    void ReportLag(int queue, std::chrono::microseconds lag);
+
+    AdmissionLimits limits_;
+    std::atomic<int> sessions_;
+    std::atomic<int64_t> rejected_;
+    std::mutex mutex_;
+    std::vector<std::chrono::microseconds> lag_;
+};
+
+
+#endif /* SRC_ADMISSION_CONTROL_H_ */
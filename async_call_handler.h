@@ -9,12 +9,15 @@ struct AsyncCallHandlerRegistry;
 struct AsyncCallHandlerInterface {
     virtual ~AsyncCallHandlerInterface() {}
     virtual void Proceed() = 0;
+    // An operation started with the handler's tag completed with ok == false
+    virtual void OnFailed() = 0;
     virtual void SetRegistry(AsyncCallHandlerRegistry * registry, int id) = 0; 
 };
 
 struct AsyncCallHandlerRegistry {
     virtual std::pair<int, AsyncCallHandlerInterface *>  Register(AsyncCallHandlerInterface * item) = 0;
     virtual void Unregister(int registerId) = 0;
+    virtual size_t Size() const = 0;
 };
 
 template < typename T >
@@ -38,6 +41,13 @@ public:
         }
     }
 
+    // By default a handler cannot make progress after a failed operation.
+    // Handlers that wait for more completions on their tag (the done
+    // notification, the other half of a call) override it.
+    virtual void OnFailed() override {
+        Unregister();
+    }
+
 
     void * Tag() const{
         return reinterpret_cast<void*>(id_);
@@ -55,6 +65,11 @@ protected:
     AsyncCallHandlerRegistry * registry() const {
         return registry_;
     }
+
+    // Static dispatch to the concrete handler
+    T & derived() {
+        return static_cast<T&>(*this);
+    }
     
 private:
     virtual void SetRegistry(AsyncCallHandlerRegistry* registry, int id) override  {
@@ -71,22 +86,38 @@ class HandlerRegistry : public AsyncCallHandlerRegistry {
 
 public:
 
-    HandlerRegistry()
-        : handlers_(), nextId_(0) {}
+    // Registries sharing a server hand out ids firstId, firstId + step, ...
+    // so ids stay unique across completion queues
+    explicit HandlerRegistry(int firstId = 0, int step = 1)
+        : handlers_(), nextId_(firstId), step_(step) {}
 
     
+    // Proceed may register further handlers, which can rehash the map: the
+    // handler is reached through item, not through the emplace iterator.
+    // item is gone on return if Proceed unregistered it.
     virtual std::pair<int, AsyncCallHandlerInterface*> Register(AsyncCallHandlerInterface* item) override{
-        int id = nextId_++;
-        auto it = handlers_.emplace(id, item);
-        it.first->second->SetRegistry(this,  id);
-        it.first->second->Proceed(); // Initializes the handler
-        return std::make_pair(id, it.first->second.get()); 
+        int id = nextId_;
+        nextId_ += step_;
+        handlers_.emplace(id, std::unique_ptr<AsyncCallHandlerInterface>(item));
+        item->SetRegistry(this,  id);
+        item->Proceed(); // Initializes the handler
+        return std::make_pair(id, item);
     }
 
     virtual void Unregister(int registerId) override {
-        handlers_.erase(registerId);
+        auto it = handlers_.find(registerId);
+        if (it == handlers_.end()) {
+            return;
+        }
+        // Destroyed after the erase, a handler may unregister others
+        std::unique_ptr<AsyncCallHandlerInterface> handler(std::move(it->second));
+        handlers_.erase(it);
     }
     
+    virtual size_t Size() const override {
+        return handlers_.size();
+    }
+
     bool TryLookupById(int id, AsyncCallHandlerInterface** out) {
         auto it = handlers_.find(id);
         if (it == handlers_.end()) {
@@ -99,6 +130,7 @@ public:
 private:
     std::unordered_map<int, std::unique_ptr<AsyncCallHandlerInterface>> handlers_;
     int nextId_;
+    int step_;
 };
 
 
@@ -0,0 +1,103 @@
+#include "async_coroutine_handler.h"
+
+#ifdef ASYNC_COROUTINES
+
+#include <new>
+#include <vector>
+
+namespace {
+
+// Frames are rounded up to this granularity
+const std::size_t kFrameGranularity = 64;
+// Largest pooled frame; bigger ones go straight to operator new
+const std::size_t kMaxPooledFrame = 4096;
+const std::size_t kSizeClasses = kMaxPooledFrame / kFrameGranularity;
+// Number of frames carved from one chunk
+const std::size_t kFramesPerChunk = 64;
+
+struct FreeFrame {
+    FreeFrame* next;
+};
+
+}
+
+
+struct CoroutineFramePool::Pool {
+
+    Pool()
+        : stats{0, 0, 0} {
+        for (auto& head : freeLists) {
+            head = nullptr;
+        }
+    }
+
+    ~Pool() {
+        for (void* chunk : chunks) {
+            ::operator delete(chunk);
+        }
+    }
+
+    FreeFrame* freeLists[kSizeClasses];
+    std::vector<void*> chunks;
+    Stats stats;
+};
+
+
+CoroutineFramePool::Pool& CoroutineFramePool::ThreadPool() {
+    thread_local Pool pool;
+    return pool;
+}
+
+
+void* CoroutineFramePool::Allocate(std::size_t size) {
+
+    Pool& pool = ThreadPool();
+
+    if (size > kMaxPooledFrame) {
+        pool.stats.oversized++;
+        return ::operator new(size);
+    }
+
+    std::size_t sizeClass = (size - 1) / kFrameGranularity;
+    FreeFrame*& head = pool.freeLists[sizeClass];
+
+    if (head == nullptr) {
+        // Refill the size class from a new chunk
+        std::size_t frameSize = (sizeClass + 1) * kFrameGranularity;
+        char* chunk = static_cast<char*>(::operator new(frameSize * kFramesPerChunk));
+        pool.chunks.push_back(chunk);
+        pool.stats.chunks++;
+
+        for (std::size_t i = 0; i < kFramesPerChunk; i++) {
+            FreeFrame* frame = reinterpret_cast<FreeFrame*>(chunk + i * frameSize);
+            frame->next = head;
+            head = frame;
+        }
+    }
+
+    FreeFrame* frame = head;
+    head = frame->next;
+    pool.stats.allocations++;
+    return frame;
+}
+
+
+void CoroutineFramePool::Free(void* p, std::size_t size) {
+
+    if (size > kMaxPooledFrame) {
+        ::operator delete(p);
+        return;
+    }
+
+    FreeFrame*& head = ThreadPool().freeLists[(size - 1) / kFrameGranularity];
+    FreeFrame* frame = static_cast<FreeFrame*>(p);
+    frame->next = head;
+    head = frame;
+}
+
+
+CoroutineFramePool::Stats CoroutineFramePool::ThreadStats() {
+    return ThreadPool().stats;
+}
+
+#endif /* ASYNC_COROUTINES */
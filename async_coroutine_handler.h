@@ -0,0 +1,246 @@
+#ifndef SRC_ASYNC_COROUTINE_HANDLER_H_
+#define SRC_ASYNC_COROUTINE_HANDLER_H_
+
+// C++20 coroutine front end for HandlerRegistry.
+//
+// A call is written as a coroutine that co_awaits CQ operations instead of a
+// Proceed() state machine:
+//
+//   CallTask Chat(CoroutineCall& call, Service* service, grpc::ServerCompletionQueue* cq) {
+//       if (!co_await call.Await([&](void* tag) { service->Requestchat(..., cq, cq, tag); })) {
+//           co_return;      // shutting down
+//       }
+//       call.Spawn(Chat, service, cq);
+//       while (co_await call.Read(stream, &msg)) {
+//           co_await call.Write(stream, reply);
+//       }
+//       co_await call.Finish(stream, grpc::Status::OK);   // client half-closed
+//   }
+//
+// Every coroutine is wrapped into a CoroutineCall registered in the
+// HandlerRegistry, so it is driven by the existing completion queue loop:
+// an operation is started with the handler's Tag(), and Proceed() or
+// OnFailed() resumes the coroutine. co_await yields the ok of the
+// completion, so a failed read (end of stream, cancellation) is seen by the
+// coroutine, which decides what is left to do. Only one operation is awaited
+// at a time. A handler unregistered while suspended, e.g. at shutdown,
+// destroys its frame and runs its destructors.
+//
+// Coroutine frames are allocated from a per-thread CoroutineFramePool.
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
+#include "async_call_handler.h"
+
+#define ASYNC_COROUTINES 1
+
+
+// Size-class free lists for coroutine frames. Memory is taken from the
+// system in chunks and recycled on the owning thread, so frame allocation
+// does not go through malloc once the pool is warm.
+class CoroutineFramePool {
+public:
+
+    struct Stats {
+        std::size_t allocations;
+        std::size_t chunks;
+        std::size_t oversized;
+    };
+
+    static void* Allocate(std::size_t size);
+
+    static void Free(void* p, std::size_t size);
+
+    // Counters of the calling thread's pool
+    static Stats ThreadStats();
+
+private:
+    struct Pool;
+    static Pool& ThreadPool();
+};
+
+
+class CoroutineCall;
+
+// Return type of a call coroutine
+class CallTask {
+public:
+
+    struct promise_type {
+
+        CallTask get_return_object() {
+            return CallTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        // Started by the first Proceed(), once the handler has its tag
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        // Kept alive until CoroutineCall releases it
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+
+        static void* operator new(std::size_t size) {
+            return CoroutineFramePool::Allocate(size);
+        }
+
+        static void operator delete(void* p, std::size_t size) {
+            CoroutineFramePool::Free(p, size);
+        }
+    };
+
+    CallTask(CallTask&& source) noexcept
+        : handle_(std::exchange(source.handle_, nullptr)) {
+    }
+
+    ~CallTask() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    CallTask(const CallTask&) = delete;
+    CallTask& operator = (const CallTask&) = delete;
+
+private:
+    friend class CoroutineCall;
+
+    explicit CallTask(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+
+class CoroutineCall : public AsyncCallHandler<CoroutineCall> {
+public:
+
+    // Awaits any operation that reports completion on the CQ with a tag.
+    // op is invoked with this handler's tag when the coroutine suspends.
+    template <typename Op>
+    struct OpAwaiter {
+        CoroutineCall* call;
+        Op op;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<>) {
+            op(call->Tag());
+        }
+
+        // ok of the completion
+        bool await_resume() const noexcept {
+            return call->ok_;
+        }
+    };
+
+    // Creates the coroutine for a new call and registers it.
+    // The body runs up to its first co_await before Register returns.
+    template <typename... Params, typename... Args>
+    static void Start(AsyncCallHandlerRegistry* registry,
+            CallTask (*body)(CoroutineCall&, Params...), Args&&... args) {
+        CoroutineCall* call = new CoroutineCall();
+        CallTask task = body(*call, std::forward<Args>(args)...);
+        call->handle_ = std::exchange(task.handle_, nullptr);
+        registry->Register(call);
+    }
+
+    // Starts another coroutine in the same registry, typically the
+    // replacement acceptor once a call has arrived
+    template <typename... Params, typename... Args>
+    void Spawn(CallTask (*body)(CoroutineCall&, Params...), Args&&... args) {
+        Start(registry(), body, std::forward<Args>(args)...);
+    }
+
+    template <typename Op>
+    OpAwaiter<Op> Await(Op op) {
+        return OpAwaiter<Op>{this, std::move(op)};
+    }
+
+    template <typename Stream, typename Message>
+    auto Read(Stream& stream, Message* msg) {
+        return Await([&stream, msg](void* tag) { stream.Read(msg, tag); });
+    }
+
+    template <typename Stream, typename Message>
+    auto Write(Stream& stream, const Message& msg, grpc::WriteOptions options = grpc::WriteOptions()) {
+        return Await([&stream, &msg, options](void* tag) { stream.Write(msg, options, tag); });
+    }
+
+    template <typename Stream, typename Message>
+    auto WriteAndFinish(Stream& stream, const Message& msg, const grpc::Status& status,
+            grpc::WriteOptions options = grpc::WriteOptions()) {
+        return Await([&stream, &msg, &status, options](void* tag) {
+            stream.WriteAndFinish(msg, options, status, tag);
+        });
+    }
+
+    template <typename Stream>
+    auto Finish(Stream& stream, const grpc::Status& status) {
+        return Await([&stream, &status](void* tag) { stream.Finish(status, tag); });
+    }
+
+    // Uses the alarm owned by the call, so waiting does not allocate
+    auto Alarm(grpc::CompletionQueue* cq, std::chrono::system_clock::time_point deadline) {
+        return Await([this, cq, deadline](void* tag) { alarm_.Set(cq, deadline, tag); });
+    }
+
+    ~CoroutineCall() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    virtual void Proceed() override {
+        Resume(true);
+    }
+
+    virtual void OnFailed() override {
+        Resume(false);
+    }
+
+private:
+
+    CoroutineCall()
+        : handle_(nullptr), ok_(true) {
+    }
+
+    void Resume(bool ok) {
+
+        ok_ = ok;
+        handle_.resume();
+
+        if (handle_.done()) {
+            // Releases the frame
+            Unregister();
+        }
+    }
+
+    std::coroutine_handle<CallTask::promise_type> handle_;
+    bool ok_;
+    grpc::Alarm alarm_;
+};
+
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* SRC_ASYNC_COROUTINE_HANDLER_H_ */
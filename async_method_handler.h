@@ -0,0 +1,613 @@
+#ifndef SRC_ASYNC_METHOD_HANDLER_H_
+#define SRC_ASYNC_METHOD_HANDLER_H_
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <new>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
+#include "async_call_handler.h"
+#include "async_stream.h"
+
+// Generic handlers for generated async methods.
+//
+// A handler is declared by deriving from one of the templates below and
+// naming the generated Request<method> member with ASYNC_METHOD:
+//
+//   class ListUsersHandler : public UnaryCallHandler<ListUsersHandler,
+//       ChatRoomService, ASYNC_METHOD(&ChatRoomService::RequestlistUsers)> { ... };
+//
+// The template owns the state machine. The derived class only implements
+// the hooks (OnRequest, OnReady, OnStart, OnRead) and is called through a
+// static_cast, so the only virtual calls per event are the Proceed() issued by
+// the completion queue loop and the operation it starts on the stream. The
+// derived class must be constructible from (Service*, grpc::ServerCompletionQueue*)
+// for unary methods and from (Service*, AsyncStreamFactoryInterface<Request, Response>*)
+// for streaming ones, e.g. a GrpcStreamFactory of the method; a new instance
+// is registered each time a call is accepted.
+
+#define ASYNC_METHOD(method) decltype(method), method
+
+
+// Deduces the request, response and responder types of a generated
+// Request<method> member function.
+template <typename MethodPtr>
+struct AsyncMethodTraits;
+
+// Unary: RequestFoo(ctx, request, responseWriter, cq, cq, tag)
+template <typename S, typename Req, typename Resp>
+struct AsyncMethodTraits<void (S::*)(grpc::ServerContext*, Req*,
+        grpc::ServerAsyncResponseWriter<Resp>*,
+        grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*)> {
+    typedef Req Request;
+    typedef Resp Response;
+    typedef grpc::ServerAsyncResponseWriter<Resp> Responder;
+};
+
+// Server streaming: RequestFoo(ctx, request, writer, cq, cq, tag)
+template <typename S, typename Req, typename Resp>
+struct AsyncMethodTraits<void (S::*)(grpc::ServerContext*, Req*,
+        grpc::ServerAsyncWriter<Resp>*,
+        grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*)> {
+    typedef Req Request;
+    typedef Resp Response;
+    typedef grpc::ServerAsyncWriter<Resp> Responder;
+};
+
+// Bidirectional streaming: RequestFoo(ctx, readerWriter, cq, cq, tag)
+template <typename S, typename Resp, typename Req>
+struct AsyncMethodTraits<void (S::*)(grpc::ServerContext*,
+        grpc::ServerAsyncReaderWriter<Resp, Req>*,
+        grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*)> {
+    typedef Req Request;
+    typedef Resp Response;
+    typedef grpc::ServerAsyncReaderWriter<Resp, Req> Responder;
+};
+
+
+// AsyncServerStreamInterface of a generated server streaming or bidi method
+template <typename Service, typename MethodPtr, MethodPtr Method>
+class GrpcServerStream : public AsyncServerStreamInterface<
+        typename AsyncMethodTraits<MethodPtr>::Request, typename AsyncMethodTraits<MethodPtr>::Response> {
+public:
+    typedef typename AsyncMethodTraits<MethodPtr>::Request Request;
+    typedef typename AsyncMethodTraits<MethodPtr>::Response Response;
+    typedef typename AsyncMethodTraits<MethodPtr>::Responder Responder;
+
+    GrpcServerStream(Service* service, grpc::ServerCompletionQueue* cq)
+        : service_(service), cq_(cq), context_(), responder_(&context_) {
+    }
+
+    virtual void RequestCall(Request* request, void* tag) override {
+        Accept(request, &responder_, tag);
+    }
+
+    virtual void NotifyWhenDone(void* tag) override {
+        context_.AsyncNotifyWhenDone(tag);
+    }
+
+    virtual void Read(Request* msg, void* tag) override {
+        ReadFrom(&responder_, msg, tag);
+    }
+
+    virtual void Write(const Response& msg, grpc::WriteOptions options, void* tag) override {
+        responder_.Write(msg, options, tag);
+    }
+
+    virtual void WriteAndFinish(const Response& msg, grpc::WriteOptions options,
+        const grpc::Status& status, void* tag) override {
+        responder_.WriteAndFinish(msg, options, status, tag);
+    }
+
+    virtual void Finish(const grpc::Status& status, void* tag) override {
+        responder_.Finish(status, tag);
+    }
+
+    virtual void Alarm(std::chrono::system_clock::time_point deadline, void* tag) override {
+        // Most calls never pause, an alarm costs an allocation of its own
+        if (!alarm_) {
+            alarm_.reset(new grpc::Alarm());
+        }
+        alarm_->Set(cq_, deadline, tag);
+    }
+
+    virtual bool IsCancelled() override {
+        return context_.IsCancelled();
+    }
+
+    virtual void TryCancel() override {
+        context_.TryCancel();
+    }
+
+    virtual grpc::ServerContext& context() override {
+        return context_;
+    }
+
+private:
+
+    void Accept(Request* request, grpc::ServerAsyncWriter<Response>* writer, void* tag) {
+        (service_->*Method)(&context_, request, writer, cq_, cq_, tag);
+    }
+
+    void Accept(Request*, grpc::ServerAsyncReaderWriter<Response, Request>* stream, void* tag) {
+        (service_->*Method)(&context_, stream, cq_, cq_, tag);
+    }
+
+    static void ReadFrom(grpc::ServerAsyncReaderWriter<Response, Request>* stream, Request* msg, void* tag) {
+        stream->Read(msg, tag);
+    }
+
+    static void ReadFrom(grpc::ServerAsyncWriter<Response>*, Request*, void*) {
+        GPR_ASSERT(false); // The request came with the call
+    }
+
+    Service* service_;
+    grpc::ServerCompletionQueue* cq_;
+    grpc::ServerContext context_;
+    Responder responder_;
+    std::unique_ptr<grpc::Alarm> alarm_;
+};
+
+
+template <typename Service, typename MethodPtr, MethodPtr Method>
+class GrpcStreamFactory : public AsyncStreamFactoryInterface<
+        typename AsyncMethodTraits<MethodPtr>::Request, typename AsyncMethodTraits<MethodPtr>::Response> {
+public:
+    typedef typename AsyncMethodTraits<MethodPtr>::Request Request;
+    typedef typename AsyncMethodTraits<MethodPtr>::Response Response;
+
+    GrpcStreamFactory(Service* service, grpc::ServerCompletionQueue* cq)
+        : service_(service), cq_(cq) {
+    }
+
+    virtual std::unique_ptr<AsyncServerStreamInterface<Request, Response>> NewStream() override {
+        return std::unique_ptr<AsyncServerStreamInterface<Request, Response>>(
+            new GrpcServerStream<Service, MethodPtr, Method>(service_, cq_));
+    }
+
+    virtual AsyncServerStreamInterface<Request, Response>* NewStream(void* storage, size_t size) override {
+        typedef GrpcServerStream<Service, MethodPtr, Method> Stream;
+        static_assert(alignof(Stream) <= alignof(std::max_align_t), "over-aligned stream");
+        if (size < sizeof(Stream)) {
+            return new Stream(service_, cq_);
+        }
+        return new (storage) Stream(service_, cq_);
+    }
+
+private:
+    Service* service_;
+    grpc::ServerCompletionQueue* cq_;
+};
+
+
+// Outbound queue for a streaming call. At most one operation (write, pause
+// or finish) is in flight at any time, so a single handler tag is enough to
+// drive it. A write immediately followed by an OK finish is coalesced into
+// WriteAndFinish.
+template <typename Response>
+class AsyncWriteQueue {
+public:
+
+    AsyncWriteQueue()
+        : state_(IDLE), finishQueued_(false) {}
+
+    void Write(const Response& msg, grpc::WriteOptions options = grpc::WriteOptions()) {
+        ops_.emplace_back(WRITE);
+        ops_.back().msg = msg;
+        ops_.back().options = options;
+    }
+
+    void Pause(std::chrono::milliseconds delay) {
+        ops_.emplace_back(PAUSE);
+        ops_.back().delay = delay;
+    }
+
+    void Finish(const grpc::Status& status) {
+        ops_.emplace_back(FINISH);
+        ops_.back().status = status;
+        finishQueued_ = true;
+    }
+
+    // True when nothing is in flight and nothing is queued
+    bool Idle() const {
+        return state_ == IDLE && ops_.empty();
+    }
+
+    // True once Finish() has been queued
+    bool Finishing() const {
+        return finishQueued_;
+    }
+
+    // Marks the in-flight operation as completed.
+    // Returns true if it was the final one and the stream is done.
+    bool Completed() {
+        if (state_ == FINISHED) {
+            return true;
+        }
+        state_ = IDLE;
+        return false;
+    }
+
+    // Starts the next queued operation unless one is already in flight
+    template <typename Stream>
+    void Pump(Stream* stream, void* tag) {
+
+        if (state_ != IDLE || ops_.empty()) {
+            return;
+        }
+
+        Op& op = ops_.front();
+
+        if (op.kind == WRITE) {
+            if (ops_.size() > 1 && ops_[1].kind == FINISH && ops_[1].status.ok()) {
+                state_ = FINISHED;
+                stream->WriteAndFinish(op.msg, op.options, ops_[1].status, tag);
+                ops_.pop_front();
+            } else {
+                state_ = WRITING;
+                stream->Write(op.msg, op.options, tag);
+            }
+        } else if (op.kind == PAUSE) {
+            state_ = PAUSED;
+            stream->Alarm(std::chrono::system_clock::now() + op.delay, tag);
+        } else {
+            state_ = FINISHED;
+            stream->Finish(op.status, tag);
+        }
+
+        ops_.pop_front();
+    }
+
+private:
+
+    enum State {
+        IDLE = 0,
+        WRITING = 1,
+        PAUSED = 2,
+        FINISHED = 3
+    };
+
+    enum Kind {
+        WRITE = 0,
+        PAUSE = 1,
+        FINISH = 2
+    };
+
+    struct Op {
+        explicit Op(Kind kind)
+            : kind(kind), delay(0) {}
+
+        Kind kind;
+        Response msg;
+        grpc::WriteOptions options;
+        std::chrono::milliseconds delay;
+        grpc::Status status;
+    };
+
+    std::deque<Op> ops_;
+    State state_;
+    bool finishQueued_;
+};
+
+
+// Unary method. Derived implements:
+//   grpc::Status OnRequest(const Request& request, Response* response);
+template <typename Derived, typename Service, typename MethodPtr, MethodPtr Method>
+class UnaryCallHandler : public AsyncCallHandler<Derived> {
+public:
+    typedef typename AsyncMethodTraits<MethodPtr>::Request Request;
+    typedef typename AsyncMethodTraits<MethodPtr>::Response Response;
+
+    UnaryCallHandler(Service* service, grpc::ServerCompletionQueue* cq)
+        : service_(service), cq_(cq), state_(CREATED), context_(), responder_(&context_) {
+    }
+
+    virtual void Proceed() override final {
+
+        switch (state_) {
+            case CREATED:
+                state_ = PROCESSING;
+                (service_->*Method)(&context_, &request_, &responder_, cq_, cq_, this->Tag());
+                break;
+
+            case PROCESSING: {
+                state_ = FINISHED;
+                // New call handler
+                this->registry()->Register(new Derived(service_, cq_));
+                grpc::Status status = this->derived().OnRequest(request_, &response_);
+                responder_.Finish(response_, status, this->Tag());
+                break;
+            }
+
+            case FINISHED:
+                this->Unregister();
+                break;
+        }
+    }
+
+protected:
+
+    Service* service() const {
+        return service_;
+    }
+
+    grpc::ServerContext& context() {
+        return context_;
+    }
+
+private:
+
+    enum State {
+        CREATED = 0,
+        PROCESSING = 1,
+        FINISHED = 2
+    };
+
+    Service* service_;
+    grpc::ServerCompletionQueue* cq_;
+    State state_;
+    grpc::ServerContext context_;
+    Request request_;
+    Response response_;
+    grpc::ServerAsyncResponseWriter<Response> responder_;
+};
+
+
+// Server streaming method. Derived implements:
+//   void OnRequest(const Request& request);  // call accepted
+//   void OnReady();                          // optional, write queue drained
+// and produces output with Write(), Pause() and Finish().
+template <typename Derived, typename Service, typename MethodPtr, MethodPtr Method>
+class ServerStreamingCallHandler : public AsyncCallHandler<Derived> {
+public:
+    typedef typename AsyncMethodTraits<MethodPtr>::Request Request;
+    typedef typename AsyncMethodTraits<MethodPtr>::Response Response;
+    typedef AsyncStreamFactoryInterface<Request, Response> StreamFactory;
+
+    ServerStreamingCallHandler(Service* service, StreamFactory* streams)
+        : service_(service), streams_(streams), state_(CREATED), stream_(streams->NewStream()) {
+    }
+
+    virtual void Proceed() override final {
+
+        if (state_ == CREATED) {
+            state_ = PROCESSING;
+            stream_->RequestCall(&request_, this->Tag());
+            return;
+        }
+
+        if (state_ == PROCESSING) {
+            state_ = STREAMING;
+            // New call handler
+            this->registry()->Register(new Derived(service_, streams_));
+            this->derived().OnRequest(request_);
+        } else if (queue_.Completed()) {
+            this->Unregister();
+            return;
+        }
+
+        if (queue_.Idle() && !queue_.Finishing()) {
+            this->derived().OnReady();
+        }
+        queue_.Pump(stream_.get(), this->Tag());
+    }
+
+protected:
+
+    // Default hook: nothing more to send until the derived class says so
+    void OnReady() {
+    }
+
+    void Write(const Response& msg, grpc::WriteOptions options = grpc::WriteOptions()) {
+        queue_.Write(msg, options);
+    }
+
+    // Delays the operations queued after it
+    void Pause(std::chrono::milliseconds delay) {
+        queue_.Pause(delay);
+    }
+
+    void Finish(const grpc::Status& status) {
+        queue_.Finish(status);
+    }
+
+    const Request& request() const {
+        return request_;
+    }
+
+    Service* service() const {
+        return service_;
+    }
+
+    grpc::ServerContext& context() {
+        return stream_->context();
+    }
+
+private:
+
+    enum State {
+        CREATED = 0,
+        PROCESSING = 1,
+        STREAMING = 2
+    };
+
+    Service* service_;
+    StreamFactory* streams_;
+    State state_;
+    std::unique_ptr<AsyncServerStreamInterface<Request, Response>> stream_;
+    Request request_;
+    AsyncWriteQueue<Response> queue_;
+};
+
+
+template <typename Request, typename Response>
+class BidiStreamWriter;
+
+// Call state shared by the reading and writing halves of a bidi call
+template <typename Request, typename Response>
+struct BidiCallState {
+    explicit BidiCallState(std::unique_ptr<AsyncServerStreamInterface<Request, Response>> stream)
+        : stream(std::move(stream)), writer(nullptr) {}
+
+    std::unique_ptr<AsyncServerStreamInterface<Request, Response>> stream;
+    BidiStreamWriter<Request, Response>* writer;
+    AsyncWriteQueue<Response> queue;
+};
+
+
+// Writing half of a bidi call. Registered by BidiStreamingCallHandler so that
+// reads and writes can be in flight at the same time under different tags.
+template <typename Request, typename Response>
+class BidiStreamWriter : public AsyncCallHandler<BidiStreamWriter<Request, Response>> {
+public:
+
+    explicit BidiStreamWriter(std::shared_ptr<BidiCallState<Request, Response>> call)
+        : call_(std::move(call)), started_(false) {
+    }
+
+    ~BidiStreamWriter() {
+        call_->writer = nullptr;
+    }
+
+    virtual void Proceed() override {
+
+        if (!started_) {
+            started_ = true;
+            call_->writer = this;
+            return;
+        }
+
+        if (call_->queue.Completed()) {
+            this->Unregister();
+            return;
+        }
+        Pump();
+    }
+
+    void Pump() {
+        call_->queue.Pump(call_->stream.get(), this->Tag());
+    }
+
+private:
+    std::shared_ptr<BidiCallState<Request, Response>> call_;
+    bool started_;
+};
+
+
+// Bidirectional streaming method. Derived implements:
+//   void OnStart();                      // call accepted
+//   void OnRead(const Request& request); // next read is armed afterwards
+// and produces output with Write(), Pause() and Finish(). The call is
+// finished with OK once reading stops, unless Finish() was queued earlier.
+template <typename Derived, typename Service, typename MethodPtr, MethodPtr Method>
+class BidiStreamingCallHandler : public AsyncCallHandler<Derived> {
+public:
+    typedef typename AsyncMethodTraits<MethodPtr>::Request Request;
+    typedef typename AsyncMethodTraits<MethodPtr>::Response Response;
+    typedef AsyncStreamFactoryInterface<Request, Response> StreamFactory;
+
+    BidiStreamingCallHandler(Service* service, StreamFactory* streams)
+        : service_(service), streams_(streams), state_(CREATED),
+        call_(std::make_shared<BidiCallState<Request, Response>>(streams->NewStream())) {
+    }
+
+    virtual void Proceed() override final {
+
+        switch (state_) {
+            case CREATED:
+                state_ = PROCESSING;
+                call_->stream->RequestCall(nullptr, this->Tag());
+                break;
+
+            case PROCESSING:
+                state_ = READING;
+                // The writer of the call, only once there is one: a request
+                // that fails leaves nothing registered behind
+                this->registry()->Register(new BidiStreamWriter<Request, Response>(call_));
+                // New call handler
+                this->registry()->Register(new Derived(service_, streams_));
+                this->derived().OnStart();
+                call_->stream->Read(&request_, this->Tag());
+                break;
+
+            case READING:
+                this->derived().OnRead(request_);
+                if (call_->queue.Finishing()) {
+                    // Nothing more to read, the writer completes the call
+                    this->Unregister();
+                    return;
+                }
+                call_->stream->Read(&request_, this->Tag());
+                break;
+        }
+    }
+
+    // The read failed: the client is done sending or gone. Destructors
+    // start no operations, the queue may be shut down by then.
+    virtual void OnFailed() override final {
+        if (state_ == READING) {
+            // Completed by the writer after what is queued
+            Finish(grpc::Status::OK);
+        }
+        this->Unregister();
+    }
+
+protected:
+
+    // Default hook: nothing to do on call start
+    void OnStart() {
+    }
+
+    void Write(const Response& msg, grpc::WriteOptions options = grpc::WriteOptions()) {
+        Enqueue().Write(msg, options);
+        Flush();
+    }
+
+    void Pause(std::chrono::milliseconds delay) {
+        Enqueue().Pause(delay);
+        Flush();
+    }
+
+    void Finish(const grpc::Status& status) {
+        if (!call_->queue.Finishing()) {
+            Enqueue().Finish(status);
+            Flush();
+        }
+    }
+
+    Service* service() const {
+        return service_;
+    }
+
+    grpc::ServerContext& context() {
+        return call_->stream->context();
+    }
+
+private:
+
+    enum State {
+        CREATED = 0,
+        PROCESSING = 1,
+        READING = 2
+    };
+
+    AsyncWriteQueue<Response>& Enqueue() {
+        return call_->queue;
+    }
+
+    void Flush() {
+        if (call_->writer != nullptr) {
+            call_->writer->Pump();
+        }
+    }
+
+    Service* service_;
+    StreamFactory* streams_;
+    State state_;
+    Request request_;
+    std::shared_ptr<BidiCallState<Request, Response>> call_;
+};
+
+
+#endif /* SRC_ASYNC_METHOD_HANDLER_H_ */
@@ -0,0 +1,104 @@
+#ifndef SRC_ASYNC_STREAM_H_
+#define SRC_ASYNC_STREAM_H_
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <grpcpp/grpcpp.h>
+
+// The operations the streaming handlers start on their call, behind an
+// interface so the handler state machines run unchanged on gRPC (see
+// GrpcServerStream in async_method_handler.h) or on a simulated completion
+// queue (simulated_completion_queue.h).
+//
+// Every operation taking a tag completes later as one (tag, ok) event on the
+// queue of the factory that made the stream, exactly like the gRPC call it
+// stands for. At most one read and one write or finish may be in flight, and
+// the stream must outlive every operation but a pending alarm and the done
+// notification.
+template <typename Request, typename Response>
+class AsyncServerStreamInterface {
+public:
+
+    virtual ~AsyncServerStreamInterface() {}
+
+    // Waits for the next call. Server streaming methods receive their
+    // request there, bidi methods pass nullptr and Read instead.
+    virtual void RequestCall(Request* request, void* tag) = 0;
+
+    // Completes tag once more when the call is over, must precede RequestCall
+    virtual void NotifyWhenDone(void* tag) = 0;
+
+    virtual void Read(Request* msg, void* tag) = 0;
+
+    virtual void Write(const Response& msg, grpc::WriteOptions options, void* tag) = 0;
+
+    virtual void WriteAndFinish(const Response& msg, grpc::WriteOptions options,
+        const grpc::Status& status, void* tag) = 0;
+
+    virtual void Finish(const grpc::Status& status, void* tag) = 0;
+
+    // Completes tag at deadline; destroying the stream cancels it
+    virtual void Alarm(std::chrono::system_clock::time_point deadline, void* tag) = 0;
+
+    // Valid once the done notification has been delivered
+    virtual bool IsCancelled() = 0;
+
+    virtual void TryCancel() = 0;
+
+    // Call settings and metadata, e.g. compression or trailers
+    virtual grpc::ServerContext& context() = 0;
+};
+
+
+// Makes the streams of one completion queue, outlives their handlers
+template <typename Request, typename Response>
+struct AsyncStreamFactoryInterface {
+
+    virtual ~AsyncStreamFactoryInterface() {}
+
+    virtual std::unique_ptr<AsyncServerStreamInterface<Request, Response>> NewStream() = 0;
+
+    // Constructs the stream in storage of size bytes, aligned for
+    // std::max_align_t, when it fits there and on the heap otherwise; see
+    // InPlaceStream
+    virtual AsyncServerStreamInterface<Request, Response>* NewStream(void* storage, size_t size) = 0;
+};
+
+
+// A stream kept inside its owner, which saves the allocation of its own
+// when Size covers the streams of the factory. Larger ones, e.g. of a
+// simulated queue, still go to the heap.
+template <typename Request, typename Response, size_t Size>
+class InPlaceStream {
+public:
+
+    typedef AsyncServerStreamInterface<Request, Response> Stream;
+
+    explicit InPlaceStream(AsyncStreamFactoryInterface<Request, Response>* factory)
+        : stream_(factory->NewStream(&storage_, sizeof(storage_))) {
+    }
+
+    ~InPlaceStream() {
+        if (dynamic_cast<void*>(stream_) == static_cast<void*>(&storage_)) {
+            stream_->~Stream();
+        } else {
+            delete stream_;
+        }
+    }
+
+    Stream* operator->() const {
+        return stream_;
+    }
+
+private:
+    InPlaceStream(const InPlaceStream&) = delete;
+    InPlaceStream& operator=(const InPlaceStream&) = delete;
+
+    typename std::aligned_storage<Size, alignof(std::max_align_t)>::type storage_;
+    Stream* stream_;
+};
+
+
+#endif /* SRC_ASYNC_STREAM_H_ */
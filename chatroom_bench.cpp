@@ -0,0 +1,1051 @@
+// In-process benchmarks for the chat hot paths. Results are printed as a
+// JSON array, one object per measured configuration.
+//
+//   broadcast  ChatRoomData::BroadcastMessage into a room of counting
+//              listeners; sweeps room size, message size and the number of
+//              threads broadcasting concurrently (one room per thread).
+//   fanout     ChatRoomData::BroadcastMessage into one large room, serial
+//              (fanout_threads 0) and split over N fan-out workers.
+//   filter     ContentFilter screening 256 byte messages against a deny-list
+//              of N terms (filter_aho_corasick), next to one std::string::find
+//              per term (filter_naive).
+//   registry   HandlerRegistry::Register + Unregister and TryLookupById
+//              with a registry prefilled with N handlers.
+//   write      Full write path: an in-process server runs the chatroom
+//              service on its own completion queue thread, N clients join
+//              over an in-process channel and an injector handler broadcasts
+//              on the CQ thread. Latency is BroadcastMessage to client receipt.
+//   lanes      As write, with 256 byte messages broadcast in bursts of N and
+//              a server notice behind every burst: latency of the chat text
+//              (lanes_data) and of the notices (lanes_notice), which skip
+//              the backlog of every session.
+//   idle       Server memory per idle chat session: a child process opens N
+//              sessions over TCP, all on one connection (idle_session) or one
+//              connection each (idle_connection), registers and then stays
+//              silent. Reported as server heap and RSS growth divided by N.
+//   listener   listUsers round trips from one client to a server on its own
+//              completion queue thread, reached over TCP loopback
+//              (listener_tcp), a unix socket (listener_unix) or the
+//              in-process channel (listener_inproc).
+//   poll       listener_tcp round trips gap_us apart, with the server
+//              thread blocking in Next (poll_block), spinning spin_us first
+//              (poll_spin) or spinning as the event rate suggests
+//              (poll_adaptive); adds the server thread's cpu per call.
+//
+// usage: chatroom-bench [key=value...]
+//   rooms=10,100,1000,10000,100000  sizes=16,256,4096  threads=1,2,4
+//   handlers=1000,100000,1000000    write-rooms=10,100,1000
+//   messages=1000                   idle-sessions=1000
+//   fanout-rooms=10000,100000       fanout-threads=0,1,2,4
+//   deny-terms=100,1000,5000
+//   listeners=tcp,unix,inproc       round-trips=5000
+//   lanes-rooms=10,100              bursts=10,100       lane-steps=20
+//   polls=block,spin,adaptive       poll-gaps=0,200,2000  spin-us=50
+//   suites=broadcast,fanout,filter,registry,write,lanes,idle,listener,poll
+//   trace=path                      Chrome trace of the run (tracing builds)
+
+#include "async_call_handler.h"
+#include "chatroom_data.h"
+#include "chatroom_service.h"
+#include "content_filter.h"
+#include "cq_poller.h"
+#include "trace.h"
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using chatroom::InboundMessage;
+using chatroom::OutboundMessage;
+
+
+// Allocation counting for allocs-per-message figures
+static std::atomic<long> allocations(0);
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+
+static int64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t CpuNanos(clockid_t clock) {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+
+// Collects latency samples and prints one JSON result object
+class Result {
+public:
+
+    Result(const std::string& name)
+        : name_(name), ops_(0), seconds_(0), allocs_(0) {
+    }
+
+    Result& Param(const std::string& key, long value) {
+        params_[key] = value;
+        return *this;
+    }
+
+    // Extra result field, e.g. a memory figure
+    Result& Metric(const std::string& key, double value) {
+        metrics_[key] = value;
+        return *this;
+    }
+
+    void Sample(int64_t nanos) {
+        samples_.push_back(nanos);
+    }
+
+    // ops: unit of throughput (messages delivered, registry calls)
+    void Done(long ops, double seconds, long allocs) {
+        ops_ = ops;
+        seconds_ = seconds;
+        allocs_ = allocs;
+    }
+
+    std::string Json() {
+
+        std::sort(samples_.begin(), samples_.end());
+        std::ostringstream os;
+        os << "{\"bench\": \"" << name_ << "\", \"params\": {";
+        bool first = true;
+        for (auto& p : params_) {
+            os << (first ? "" : ", ") << "\"" << p.first << "\": " << p.second;
+            first = false;
+        }
+        os << "}, \"ops\": " << ops_
+            << ", \"ops_per_sec\": " << static_cast<long>(seconds_ > 0 ? ops_ / seconds_ : 0)
+            << ", \"allocs_per_op\": " << (ops_ > 0 ? static_cast<double>(allocs_) / ops_ : 0)
+            << ", \"samples\": " << samples_.size()
+            << ", \"p50_ns\": " << Percentile(0.50)
+            << ", \"p99_ns\": " << Percentile(0.99)
+            << ", \"p999_ns\": " << Percentile(0.999);
+        for (auto& m : metrics_) {
+            os << ", \"" << m.first << "\": " << static_cast<long>(m.second);
+        }
+        os << "}";
+        return os.str();
+    }
+
+private:
+
+    int64_t Percentile(double p) const {
+        if (samples_.empty()) {
+            return 0;
+        }
+        return samples_[static_cast<size_t>(p * (samples_.size() - 1))];
+    }
+
+    std::string name_;
+    std::map<std::string, long> params_;
+    std::map<std::string, double> metrics_;
+    std::vector<int64_t> samples_;
+    long ops_;
+    double seconds_;
+    long allocs_;
+};
+
+
+static std::vector<std::string> results;
+
+static void Report(Result& result) {
+    results.push_back(result.Json());
+    std::cerr << results.back() << std::endl;
+}
+
+
+// ---------------------------------------------------------------------------
+// broadcast
+
+class CountingListener : public EventListenerInterface {
+public:
+    CountingListener()
+        : received(0) {
+    }
+
+    virtual void PostMessage(const std::shared_ptr<InboundMessage>&) override {
+        received++;
+    }
+
+    long received;
+};
+
+
+static void BenchBroadcast(int roomSize, int messageSize, int threads) {
+
+    // Keep the total work per configuration roughly constant
+    long broadcasts = std::max(20L, 2000000L / roomSize);
+
+    std::vector<std::vector<int64_t>> samples(threads);
+    std::vector<std::thread> workers;
+    long allocsBefore = allocations;
+    int64_t begin = NowNanos();
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            ChatRoomData room;
+            std::vector<CountingListener> listeners(roomSize);
+            std::vector<std::string> names;
+            for (int i = 0; i < roomSize; i++) {
+                names.push_back("user" + std::to_string(i));
+                room.EnterRoom(names.back(), i, &listeners[i]);
+            }
+
+            std::string message(messageSize, 'x');
+            samples[t].reserve(broadcasts);
+            for (long b = 0; b < broadcasts; b++) {
+                int64_t start = NowNanos();
+                int sender = static_cast<int>(b % roomSize);
+                room.BroadcastMessage(sender, names[sender], message, &listeners[sender]);
+                samples[t].push_back(NowNanos() - start);
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    double seconds = (NowNanos() - begin) / 1e9;
+    // Room setup allocations are included, they are negligible next to the fan-out
+    long allocs = allocations - allocsBefore;
+
+    Result result("broadcast");
+    result.Param("room_size", roomSize).Param("message_size", messageSize).Param("threads", threads);
+    for (auto& s : samples) {
+        for (int64_t v : s) {
+            result.Sample(v);
+        }
+    }
+    result.Done(broadcasts * threads * (roomSize - 1), seconds, allocs);
+    Report(result);
+}
+
+
+// ---------------------------------------------------------------------------
+// fanout
+
+static void BenchFanOut(int roomSize, int fanOutThreads) {
+
+    long broadcasts = std::max(20L, 20000000L / roomSize);
+
+    ChatRoomData room;
+    room.SetFanOutThreads(fanOutThreads);
+    // Every listener is touched by one chunk only, the counters need no sync
+    std::vector<CountingListener> listeners(roomSize);
+    std::vector<std::string> names;
+    for (int i = 0; i < roomSize; i++) {
+        names.push_back("user" + std::to_string(i));
+        room.EnterRoom(names.back(), i, &listeners[i]);
+    }
+
+    Result result("fanout");
+    result.Param("room_size", roomSize).Param("fanout_threads", fanOutThreads);
+
+    std::string message(64, 'x');
+    long allocsBefore = allocations;
+    int64_t begin = NowNanos();
+
+    for (long b = 0; b < broadcasts; b++) {
+        int64_t start = NowNanos();
+        int sender = static_cast<int>(b % roomSize);
+        room.BroadcastMessage(sender, names[sender], message, &listeners[sender]);
+        result.Sample(NowNanos() - start);
+    }
+
+    double seconds = (NowNanos() - begin) / 1e9;
+    result.Done(broadcasts * (roomSize - 1), seconds, allocations - allocsBefore);
+    Report(result);
+}
+
+
+// ---------------------------------------------------------------------------
+// filter
+
+static void BenchFilter(int termCount) {
+
+    std::mt19937 random(7);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::uniform_int_distribution<int> length(5, 12);
+
+    std::vector<std::string> terms(termCount);
+    for (auto& term : terms) {
+        term.resize(length(random));
+        for (auto& c : term) {
+            c = static_cast<char>(letter(random));
+        }
+    }
+
+    // Words of the same alphabet, every few messages embeds a term
+    const int kMessages = 1000;
+    std::vector<std::string> messages(kMessages);
+    for (int m = 0; m < kMessages; m++) {
+        while (messages[m].size() < 256) {
+            std::string word(length(random) / 2, ' ');
+            for (auto& c : word) {
+                c = static_cast<char>(letter(random));
+            }
+            messages[m] += word + " ";
+        }
+        if (m % 8 == 0) {
+            messages[m].replace(100, terms[m % termCount].size(), terms[m % termCount]);
+        }
+        messages[m].resize(256);
+    }
+
+    // The naive loop is linear in the terms, keep its run time bounded
+    long passes = 100;
+    long naivePasses = std::max(1L, 20000L / termCount);
+
+    ContentFilter filter(FILTER_MASK);
+    filter.SetTerms(terms);
+    {
+        Result result("filter_aho_corasick");
+        result.Param("terms", termCount).Param("message_size", 256);
+        // Masking rewrites the text, work on a copy that keeps its buffer
+        std::string text;
+        text.reserve(256);
+        long allocsBefore = allocations;
+        int64_t begin = NowNanos();
+        for (long p = 0; p < passes; p++) {
+            for (auto& message : messages) {
+                text.assign(message);
+                int64_t start = NowNanos();
+                filter.Process("bench", &text);
+                result.Sample(NowNanos() - start);
+            }
+        }
+        double seconds = (NowNanos() - begin) / 1e9;
+        result.Param("matched", filter.matched() / passes);
+        result.Done(passes * kMessages, seconds, allocations - allocsBefore);
+        Report(result);
+    }
+    {
+        Result result("filter_naive");
+        result.Param("terms", termCount).Param("message_size", 256);
+        long allocsBefore = allocations;
+        long found = 0;
+        int64_t begin = NowNanos();
+        for (long p = 0; p < naivePasses; p++) {
+            for (auto& message : messages) {
+                int64_t start = NowNanos();
+                bool match = false;
+                for (auto& term : terms) {
+                    match = message.find(term) != std::string::npos || match;
+                }
+                found += match;
+                result.Sample(NowNanos() - start);
+            }
+        }
+        double seconds = (NowNanos() - begin) / 1e9;
+        result.Param("matched", found / naivePasses);
+        result.Done(naivePasses * kMessages, seconds, allocations - allocsBefore);
+        Report(result);
+    }
+}
+
+
+// ---------------------------------------------------------------------------
+// registry
+
+class NoopHandler : public AsyncCallHandler<NoopHandler> {
+public:
+    virtual void Proceed() override {
+    }
+};
+
+
+static void BenchRegistry(int handlers) {
+
+    HandlerRegistry registry;
+    std::vector<int> ids;
+    ids.reserve(handlers);
+    for (int i = 0; i < handlers; i++) {
+        ids.push_back(registry.Register(new NoopHandler()).first);
+    }
+
+    const long ops = 200000;
+    std::mt19937 random(42);
+
+    {
+        Result result("registry_register_unregister");
+        result.Param("handlers", handlers);
+        long allocsBefore = allocations;
+        int64_t begin = NowNanos();
+        for (long i = 0; i < ops; i++) {
+            int64_t start = NowNanos();
+            int id = registry.Register(new NoopHandler()).first;
+            registry.Unregister(id);
+            result.Sample(NowNanos() - start);
+        }
+        result.Done(ops, (NowNanos() - begin) / 1e9, allocations - allocsBefore);
+        Report(result);
+    }
+
+    {
+        Result result("registry_lookup");
+        result.Param("handlers", handlers);
+        std::uniform_int_distribution<size_t> pick(0, ids.size() - 1);
+        AsyncCallHandlerInterface* handler;
+        long found = 0;
+        long allocsBefore = allocations;
+        int64_t begin = NowNanos();
+        for (long i = 0; i < ops; i++) {
+            int id = ids[pick(random)];
+            int64_t start = NowNanos();
+            found += registry.TryLookupById(id, &handler);
+            result.Sample(NowNanos() - start);
+        }
+        result.Done(found, (NowNanos() - begin) / 1e9, allocations - allocsBefore);
+        Report(result);
+    }
+}
+
+
+// Same loop as ServerImpl::HandleRpcs
+static void ServeCompletionQueue(HandlerRegistry& registry, grpc::ServerCompletionQueue* cq,
+    const PollSettings& poll = PollSettings()) {
+
+    CompletionQueuePoller poller(cq, poll);
+    void* tag;
+    bool ok;
+    while (poller.Next(&tag, &ok)) {
+        int id = reinterpret_cast<intptr_t>(tag);
+        AsyncCallHandlerInterface* handler;
+        if (registry.TryLookupById(id, &handler)) {
+            if (ok) {
+                handler->Proceed();
+            } else {
+                handler->OnFailed();
+            }
+        }
+    }
+}
+
+
+// ---------------------------------------------------------------------------
+// write
+
+// Runs on the server CQ thread: joins the room without a listener and
+// broadcasts timestamped messages once the clients are ready. With a burst
+// of more than one message every step also posts a timestamped notice
+// behind its burst.
+class BroadcastInjector : public AsyncCallHandler<BroadcastInjector> {
+public:
+    BroadcastInjector(ChatRoomService* service, grpc::ServerCompletionQueue* cq,
+        std::atomic<bool>* go, int messages, int messageSize, int burst, Result* result)
+        : service_(service), cq_(cq), go_(go), messages_(messages),
+        messageSize_(messageSize), burst_(burst), sent_(0), inRoom_(false), result_(result) {
+    }
+
+    virtual void Proceed() override {
+
+        if (!*go_) {
+            // Poll until the clients have joined
+            alarm_.Set(cq_, std::chrono::system_clock::now() + std::chrono::milliseconds(1), Tag());
+            return;
+        }
+
+        if (!inRoom_) {
+            inRoom_ = true;
+            service_->EnterRoom("bench", Id(), nullptr);
+        }
+
+        if (sent_ == messages_) {
+            service_->LeaveRoom(Id());
+            Unregister();
+            return;
+        }
+
+        for (int i = 0; i < burst_; i++) {
+            std::string text = std::to_string(NowNanos());
+            text.resize(std::max<size_t>(text.size() + 1, messageSize_), ' ');
+
+            int64_t start = NowNanos();
+            service_->BroadcastMessage(Id(), "bench", text, nullptr);
+            result_->Sample(NowNanos() - start);
+        }
+        if (burst_ > 1) {
+            service_->PostNotice(std::to_string(NowNanos()));
+        }
+        sent_++;
+
+        // Yield to the write completions between broadcasts
+        alarm_.Set(cq_, std::chrono::system_clock::now(), Tag());
+    }
+
+private:
+    ChatRoomService* service_;
+    grpc::ServerCompletionQueue* cq_;
+    std::atomic<bool>* go_;
+    int messages_;
+    int messageSize_;
+    int burst_;
+    int sent_;
+    bool inRoom_;
+    Result* result_;
+    grpc::Alarm alarm_;
+};
+
+
+struct BenchClient {
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientAsyncReaderWriter<OutboundMessage, InboundMessage>> stream;
+    OutboundMessage registration;
+    InboundMessage inbound;
+    bool joined = false;
+};
+
+
+// burst 1: the write suite. Otherwise the lanes suite, messages steps of
+// burst chat messages and a notice each, notice latency reported apart.
+static void BenchWrite(int roomSize, int messageSize, int messages, int burst) {
+
+    ChatRoomService service;
+    grpc::ServerBuilder builder;
+    builder.RegisterService(&service);
+    std::unique_ptr<grpc::ServerCompletionQueue> cq = builder.AddCompletionQueue();
+    std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+
+    std::atomic<bool> go(false);
+    Result broadcastResult("write_fanout");
+    broadcastResult.Param("room_size", roomSize).Param("message_size", messageSize);
+
+    std::thread serverThread([&]() {
+        HandlerRegistry registry;
+        service.BuildAsyncHandlers(&registry, cq.get());
+        registry.Register(new BroadcastInjector(&service, cq.get(), &go, messages, messageSize, burst, &broadcastResult));
+        ServeCompletionQueue(registry, cq.get());
+    });
+
+    auto channel = server->InProcessChannel(grpc::ChannelArguments());
+    auto stub = ChatRoom::NewStub(channel);
+    grpc::CompletionQueue clientCq;
+    std::vector<std::unique_ptr<BenchClient>> clients;
+
+    // Tag layout: client index * 4 + operation
+    enum Op { STARTED = 0, REGISTERED = 1, RECEIVED = 2, FINISHED = 3 };
+
+    for (int i = 0; i < roomSize; i++) {
+        clients.emplace_back(new BenchClient());
+        BenchClient& c = *clients.back();
+        c.registration.mutable_event()->set_username("user" + std::to_string(i));
+        c.stream = stub->Asyncchat(&c.context, &clientCq, reinterpret_cast<void*>(static_cast<intptr_t>(i * 4 + STARTED)));
+    }
+
+    Result deliveryResult(burst > 1 ? "lanes_data" : "write_delivery");
+    deliveryResult.Param("room_size", roomSize).Param("message_size", messageSize);
+    Result noticeResult("lanes_notice");
+    noticeResult.Param("room_size", roomSize).Param("message_size", messageSize);
+
+    int joined = 0;
+    long delivered = 0;
+    long expected = static_cast<long>(roomSize) * messages * (burst > 1 ? burst + 1 : 1);
+    long allocsBefore = 0;
+    int64_t begin = 0;
+    int64_t lastDelivery = 0;
+
+    void* tag;
+    bool ok;
+    while (delivered < expected) {
+
+        auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(2);
+        grpc::CompletionQueue::NextStatus status = clientCq.AsyncNext(&tag, &ok, deadline);
+        if (status != grpc::CompletionQueue::GOT_EVENT) {
+            break; // Delivery stalled, e.g. messages dropped by busy writers
+        }
+
+        intptr_t value = reinterpret_cast<intptr_t>(tag);
+        BenchClient& c = *clients[value / 4];
+        void* readTag = reinterpret_cast<void*>(value - value % 4 + RECEIVED);
+
+        if (!ok) {
+            continue;
+        }
+
+        switch (value % 4) {
+            case STARTED:
+                c.stream->Write(c.registration, reinterpret_cast<void*>(value - STARTED + REGISTERED));
+                break;
+
+            case REGISTERED:
+                c.stream->Read(&c.inbound, readTag);
+                break;
+
+            case RECEIVED:
+                if (!c.joined) {
+                    // Welcome message
+                    c.joined = true;
+                    if (++joined == roomSize) {
+                        allocsBefore = allocations;
+                        begin = NowNanos();
+                        go = true;
+                    }
+                } else {
+                    lastDelivery = NowNanos();
+                    int64_t latency = lastDelivery - std::atoll(c.inbound.message().message().c_str());
+                    (c.inbound.message().sender().empty() ? noticeResult : deliveryResult).Sample(latency);
+                    delivered++;
+                }
+                c.stream->Read(&c.inbound, readTag);
+                break;
+        }
+    }
+
+    long allocs = allocations - allocsBefore;
+    double seconds = begin > 0 && lastDelivery > begin ? (lastDelivery - begin) / 1e9 : 0;
+
+    server->Shutdown();
+    cq->Shutdown();
+    serverThread.join();
+
+    for (auto& c : clients) {
+        c->context.TryCancel();
+    }
+    clientCq.Shutdown();
+    while (clientCq.Next(&tag, &ok)) {
+    }
+
+    deliveryResult.Param("messages", messages).Param("expected", expected);
+    deliveryResult.Done(delivered, seconds, allocs);
+    if (burst > 1) {
+        deliveryResult.Param("burst", burst);
+        noticeResult.Param("messages", messages).Param("burst", burst);
+        noticeResult.Done(delivered, seconds, allocs);
+        Report(deliveryResult);
+        Report(noticeResult);
+        return;
+    }
+    broadcastResult.Param("messages", messages);
+    broadcastResult.Done(delivered, seconds, allocs);
+    Report(broadcastResult);
+    Report(deliveryResult);
+}
+
+
+// ---------------------------------------------------------------------------
+// idle
+
+// Heap in use, including gRPC core allocations that bypass operator new
+static long HeapBytes() {
+    struct mallinfo2 info = mallinfo2();
+    return static_cast<long>(info.uordblks + info.hblkhd);
+}
+
+static long RssBytes() {
+    long pages = 0;
+    long resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+// Child process side: opens the sessions, reports "ready" on stdout and
+// keeps them open until stdin is closed
+static int RunIdleClients(const std::string& address, int sessions, int connections) {
+
+    std::vector<std::unique_ptr<ChatRoom::Stub>> stubs;
+    for (int i = 0; i < connections; i++) {
+        // A private subchannel pool gives every channel its own connection
+        grpc::ChannelArguments args;
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+        stubs.push_back(ChatRoom::NewStub(
+            grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args)));
+    }
+
+    std::vector<std::unique_ptr<grpc::ClientContext>> contexts;
+    std::vector<std::unique_ptr<grpc::ClientReaderWriter<OutboundMessage, InboundMessage>>> streams;
+
+    for (int i = 0; i < sessions; i++) {
+        contexts.emplace_back(new grpc::ClientContext());
+        streams.emplace_back(stubs[i % connections]->chat(contexts.back().get()));
+
+        OutboundMessage registration;
+        registration.mutable_event()->set_username("user" + std::to_string(i));
+        InboundMessage welcome;
+        if (!streams.back()->Write(registration) || !streams.back()->Read(&welcome)) {
+            return 1;
+        }
+    }
+
+    std::cout << "ready" << std::endl;
+    std::string line;
+    std::getline(std::cin, line);
+    _exit(0);
+}
+
+
+static void BenchIdle(const std::string& program, int sessions, int connections) {
+
+    ChatRoomService service;
+    grpc::ServerBuilder builder;
+    int port = 0;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+    builder.RegisterService(&service);
+    std::unique_ptr<grpc::ServerCompletionQueue> cq = builder.AddCompletionQueue();
+    std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+
+    std::thread serverThread([&]() {
+        HandlerRegistry registry;
+        service.BuildAsyncHandlers(&registry, cq.get());
+        ServeCompletionQueue(registry, cq.get());
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    long heapBefore = HeapBytes();
+    long rssBefore = RssBytes();
+
+    std::string arg = "idle-client=127.0.0.1:" + std::to_string(port) + "," +
+        std::to_string(sessions) + "," + std::to_string(connections);
+
+    int toChild[2];
+    int fromChild[2];
+    if (pipe(toChild) != 0 || pipe(fromChild) != 0) {
+        std::cerr << "pipe failed" << std::endl;
+        return;
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(toChild[0], 0);
+        dup2(fromChild[1], 1);
+        close(toChild[1]);
+        close(fromChild[0]);
+        execl("/proc/self/exe", program.c_str(), arg.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    close(toChild[0]);
+    close(fromChild[1]);
+
+    // Blocks until the child has opened every session
+    char ready[6] = {};
+    bool opened = child > 0 && read(fromChild[0], ready, 5) == 5 && std::string(ready) == "ready";
+
+    // Let the last welcome writes complete
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    long heap = HeapBytes() - heapBefore;
+    long rss = RssBytes() - rssBefore;
+
+    close(toChild[1]);
+    close(fromChild[0]);
+    if (child > 0) {
+        waitpid(child, nullptr, 0);
+    }
+
+    // The sessions end on their own once the child is gone; shutting the
+    // queue down before would race the events they still post to it
+    for (int i = 0; i < 500 && service.admission().sessions() > 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    server->Shutdown();
+    cq->Shutdown();
+    serverThread.join();
+
+    Result result(connections == 1 ? "idle_session" : "idle_connection");
+    result.Param("sessions", sessions).Param("connections", connections);
+    result.Done(opened ? sessions : 0, 0, 0);
+    result.Metric("heap_bytes_per_session", opened ? static_cast<double>(heap) / sessions : 0);
+    result.Metric("rss_bytes_per_session", opened ? static_cast<double>(rss) / sessions : 0);
+    Report(result);
+}
+
+
+// ---------------------------------------------------------------------------
+// listener
+
+// listUsers round trips over listener to a server polling as set by poll,
+// gapMicros apart; reports latency and the server thread's cpu per call
+static void BenchRoundTrips(Result& result, const std::string& listener, int roundTrips,
+    const PollSettings& poll, int gapMicros) {
+
+    ChatRoomService service;
+    grpc::ServerBuilder builder;
+    int port = 0;
+    std::string path = "/tmp/chatroom-bench-" + std::to_string(getpid()) + ".sock";
+    if (listener == "tcp") {
+        builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+    } else if (listener == "unix") {
+        builder.AddListeningPort("unix:" + path, grpc::InsecureServerCredentials());
+    } else if (listener != "inproc") {
+        std::cerr << "unknown listener " << listener << std::endl;
+        return;
+    }
+    builder.RegisterService(&service);
+    std::unique_ptr<grpc::ServerCompletionQueue> cq = builder.AddCompletionQueue();
+    std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+    if (!server) {
+        std::cerr << "cannot listen over " << listener << std::endl;
+        return;
+    }
+
+    std::thread serverThread([&]() {
+        HandlerRegistry registry;
+        service.BuildAsyncHandlers(&registry, cq.get());
+        ServeCompletionQueue(registry, cq.get(), poll);
+    });
+    clockid_t serverClock;
+    pthread_getcpuclockid(serverThread.native_handle(), &serverClock);
+
+    std::shared_ptr<grpc::Channel> channel;
+    if (listener == "tcp") {
+        channel = grpc::CreateChannel("127.0.0.1:" + std::to_string(port), grpc::InsecureChannelCredentials());
+    } else if (listener == "unix") {
+        channel = grpc::CreateChannel("unix:" + path, grpc::InsecureChannelCredentials());
+    } else {
+        channel = server->InProcessChannel(grpc::ChannelArguments());
+    }
+    auto stub = ChatRoom::NewStub(channel);
+
+    result.Param("round_trips", roundTrips);
+    long completed = 0;
+
+    // The first calls connect
+    int warmUp = std::min(roundTrips, 100);
+    long allocsBefore = 0;
+    int64_t begin = 0;
+    int64_t cpuBegin = 0;
+    for (int i = 0; i < warmUp + roundTrips; i++) {
+        if (i == warmUp) {
+            allocsBefore = allocations;
+            begin = NowNanos();
+            cpuBegin = CpuNanos(serverClock);
+        }
+        if (gapMicros > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(gapMicros));
+        }
+        grpc::ClientContext context;
+        ListUsersRequest request;
+        ListUsersResponse response;
+        int64_t start = NowNanos();
+        bool ok = stub->listUsers(&context, request, &response).ok();
+        if (i >= warmUp && ok) {
+            result.Sample(NowNanos() - start);
+            completed++;
+        }
+    }
+    result.Done(completed, (NowNanos() - begin) / 1e9, allocations - allocsBefore);
+    result.Metric("server_cpu_us_per_call", completed ? (CpuNanos(serverClock) - cpuBegin) / 1e3 / completed : 0);
+
+    server->Shutdown();
+    cq->Shutdown();
+    serverThread.join();
+    unlink(path.c_str());
+
+    Report(result);
+}
+
+static void BenchListener(const std::string& listener, int roundTrips) {
+    Result result("listener_" + listener);
+    BenchRoundTrips(result, listener, roundTrips, PollSettings(), 0);
+}
+
+static void BenchPoll(const std::string& mode, int gapMicros, int spinMicros, int roundTrips) {
+
+    PollSettings poll;
+    poll.spin = std::chrono::microseconds(spinMicros);
+    if (mode == "spin") {
+        poll.mode = POLL_SPIN;
+    } else if (mode == "adaptive") {
+        poll.mode = POLL_ADAPTIVE;
+    } else if (mode != "block") {
+        std::cerr << "unknown poll mode " << mode << std::endl;
+        return;
+    }
+
+    Result result("poll_" + mode);
+    result.Param("gap_us", gapMicros).Param("spin_us", spinMicros);
+    BenchRoundTrips(result, "tcp", roundTrips, poll, gapMicros);
+}
+
+
+// ---------------------------------------------------------------------------
+
+static std::vector<int> ParseList(const std::string& value) {
+    std::vector<int> list;
+    std::istringstream is(value);
+    std::string item;
+    while (std::getline(is, item, ',')) {
+        list.push_back(std::atoi(item.c_str()));
+    }
+    return list;
+}
+
+
+int main(int argc, char** argv) {
+
+    std::map<std::string, std::string> options = {
+        {"rooms", "10,100,1000,10000,100000"},
+        {"sizes", "16,256,4096"},
+        {"threads", "1,2,4"},
+        {"handlers", "1000,100000,1000000"},
+        {"write-rooms", "10,100,1000"},
+        {"messages", "1000"},
+        {"idle-sessions", "1000"},
+        {"idle-client", ""},
+        {"fanout-rooms", "10000,100000"},
+        {"fanout-threads", "0,1,2,4"},
+        {"deny-terms", "100,1000,5000"},
+        {"listeners", "tcp,unix,inproc"},
+        {"round-trips", "5000"},
+        {"lanes-rooms", "10,100"},
+        {"bursts", "10,100"},
+        {"lane-steps", "20"},
+        {"polls", "block,spin,adaptive"},
+        {"poll-gaps", "0,200,2000"},
+        {"spin-us", "50"},
+        {"suites", "broadcast,fanout,filter,registry,write,lanes,idle,listener,poll"},
+        {"trace", ""},
+    };
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos || options.find(arg.substr(0, eq)) == options.end()) {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+        options[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+
+    if (!options["idle-client"].empty()) {
+        // address,sessions,connections
+        std::vector<std::string> fields;
+        std::istringstream is(options["idle-client"]);
+        std::string field;
+        while (std::getline(is, field, ',')) {
+            fields.push_back(field);
+        }
+        if (fields.size() != 3) {
+            return 1;
+        }
+        return RunIdleClients(fields[0], std::atoi(fields[1].c_str()), std::atoi(fields[2].c_str()));
+    }
+
+    const std::string& suites = options["suites"];
+
+    if (suites.find("broadcast") != std::string::npos) {
+        for (int room : ParseList(options["rooms"])) {
+            for (int size : ParseList(options["sizes"])) {
+                for (int threads : ParseList(options["threads"])) {
+                    BenchBroadcast(room, size, threads);
+                }
+            }
+        }
+    }
+
+    if (suites.find("fanout") != std::string::npos) {
+        for (int room : ParseList(options["fanout-rooms"])) {
+            for (int threads : ParseList(options["fanout-threads"])) {
+                BenchFanOut(room, threads);
+            }
+        }
+    }
+
+    if (suites.find("filter") != std::string::npos) {
+        for (int terms : ParseList(options["deny-terms"])) {
+            BenchFilter(terms);
+        }
+    }
+
+    if (suites.find("registry") != std::string::npos) {
+        for (int handlers : ParseList(options["handlers"])) {
+            BenchRegistry(handlers);
+        }
+    }
+
+    if (suites.find("write") != std::string::npos) {
+        for (int room : ParseList(options["write-rooms"])) {
+            for (int size : ParseList(options["sizes"])) {
+                BenchWrite(room, size, std::atoi(options["messages"].c_str()), 1);
+            }
+        }
+    }
+
+    if (suites.find("lanes") != std::string::npos) {
+        for (int room : ParseList(options["lanes-rooms"])) {
+            for (int burst : ParseList(options["bursts"])) {
+                BenchWrite(room, 256, std::atoi(options["lane-steps"].c_str()), burst);
+            }
+        }
+    }
+
+    if (suites.find("idle") != std::string::npos) {
+        for (int sessions : ParseList(options["idle-sessions"])) {
+            BenchIdle(argv[0], sessions, 1);
+            BenchIdle(argv[0], sessions, sessions);
+        }
+    }
+
+    if (suites.find("listener") != std::string::npos) {
+        std::istringstream listeners(options["listeners"]);
+        std::string listener;
+        while (std::getline(listeners, listener, ',')) {
+            BenchListener(listener, std::atoi(options["round-trips"].c_str()));
+        }
+    }
+
+    if (suites.find("poll") != std::string::npos) {
+        std::istringstream polls(options["polls"]);
+        std::string mode;
+        while (std::getline(polls, mode, ',')) {
+            for (int gap : ParseList(options["poll-gaps"])) {
+                BenchPoll(mode, gap, std::atoi(options["spin-us"].c_str()), std::atoi(options["round-trips"].c_str()));
+            }
+        }
+    }
+
+#ifdef CHAT_TRACING
+    if (!options["trace"].empty()) {
+        TraceExportChromeJson(options["trace"]);
+    }
+#endif
+
+    std::cout << "[" << std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        std::cout << "  " << results[i] << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    std::cout << "]" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "chatroom_callback_service.h"
+#include "chatroom_federation.h"
+#include "server_options.h"
+#include "content_filter.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+
+using grpc::Server;
+using grpc::ServerBuilder;
+
+
+class ServerImpl {
+public:
+
+    explicit ServerImpl(const ServerOptions& options)
+        : options_(options), relayService_(&service_) {
+    }
+
+    ~ServerImpl() {
+        if (!server_) {
+            return;
+        }
+        server_->Shutdown();
+    }
+
+
+    // There is no shutdown handling in this code.
+    // False when the server could not be set up
+    bool Run() {
+        ServerBuilder builder;
+        // Listen on every given address, tcp or unix socket, without any
+        // authentication mechanism.
+        AddListeners(options_, &builder);
+        // Register "service_" as the instance through which we'll communicate with
+        // clients. Reactions are run by gRPC's callback threads, there is no
+        // completion queue to poll.
+        builder.RegisterService(&service_);
+        // Default for every call; streaming calls negotiate their own below
+        builder.SetDefaultCompressionAlgorithm(options_.compression);
+        service_.SetCompressionPolicy(
+            CompressionPolicy(options_.streamCompression, options_.compressionThreshold));
+        // New chat streams beyond these limits are shed
+        service_.admission().SetLimits(options_.admission);
+        // gRPC runs the reactions on its own threads, only the fan-out
+        // workers are placed
+        service_.SetFanOutThreads(options_.fanOutThreads, PlaceFanOutWorkers(
+            PlanCpuPlacement(options_.fanOutThreads, options_.pinning, options_.cpus, options_.reservedCpus)));
+        if (options_.fairnessRatio > 0) {
+            service_.SetFairnessRatio(options_.fairnessRatio);
+        }
+        if (!options_.denyList.empty()) {
+            filter_.reset(new ContentFilter(options_.filterAction));
+            if (!filter_->Load(options_.denyList)) {
+                std::cerr << "Cannot read deny-list " << options_.denyList << std::endl;
+                return false;
+            }
+            // kill -HUP <pid> picks up an edited list
+            filter_->InstallReloadSignal(options_.denyList);
+            service_.pipeline().AddStage(filter_.get());
+        }
+        if (options_.memoryQuota > 0) {
+            grpc::ResourceQuota quota("chatroom");
+            quota.Resize(options_.memoryQuota);
+            builder.SetResourceQuota(quota);
+        }
+        if (!options_.peers.empty()) {
+            // Peer nodes relay their users and messages here
+            if (options_.relayToken.empty()) {
+                std::cerr << "Relay calls are not authenticated, see --relay-token" << std::endl;
+            }
+            relayService_.SetToken(options_.relayToken);
+            builder.RegisterService(&relayService_);
+            federation_.reset(new ChatFederation(options_.node, options_.peers, options_.relayToken));
+            service_.SetRelay(federation_.get());
+        }
+        // Finally assemble the server.
+        server_ = builder.BuildAndStart();
+        if (!server_) {
+            std::cerr << "Cannot listen on " << FormatAddresses(options_) << std::endl;
+            return false;
+        }
+        std::cout << "Server listening on " << FormatAddresses(options_) << std::endl;
+
+        server_->Wait();
+        return true;
+    }
+
+
+private:
+   ServerOptions options_;
+   // Outlives the room that reports to it
+   std::unique_ptr<ChatFederation> federation_;
+   std::unique_ptr<ContentFilter> filter_;
+   ChatRoomCallbackService service_;
+   ChatRelayCallbackService relayService_;
+   std::unique_ptr<Server> server_;
+};
+
+
+
+
+
+int main(int argc, char** argv) {
+
+  ServerOptions options;
+  if (!ParseServerOptions(argc, argv, &options)) {
+    return 1;
+  }
+
+  ServerImpl server(options);
+  return server.Run() ? 0 : 1;
+}
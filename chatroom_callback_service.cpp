@@ -0,0 +1,347 @@
+#include "chatroom_callback_service.h"
+#include "chatroom_federation.h"
+#include "outbound_lanes.h"
+#include <atomic>
+#include <sstream>
+#include <vector>
+
+
+// One reactor per chat stream. Reads are processed one at a time; outbound
+// messages are queued by priority and written one at a time.
+class ChatReactor : public grpc::ServerBidiReactor<OutboundMessage, InboundMessage>,
+                    public EventListenerInterface {
+public:
+
+    ChatReactor(ChatRoomCallbackService* service, grpc::CallbackServerContext* context)
+        : service_(service), sessionId_(service->NextSessionId()), userInChat_(false),
+        lanes_(service->fairnessRatio()), goodbye_(false), finishDue_(false), finished_(false) {
+
+        service->compression().ApplyToCall(context);
+
+        auto welcome = std::make_shared<InboundMessage>();
+        welcome->mutable_message()->set_message("Welcome to the chat!");
+        PostMessage(welcome);
+
+        StartRead(&request_);
+    }
+
+    virtual void PostMessage(const std::shared_ptr<InboundMessage>& msg) override {
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        order_.Post(msg, [this](const std::shared_ptr<InboundMessage>& next) {
+            Enqueue(next);
+        });
+    }
+
+    virtual void Joined(uint64_t sequence) override {
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        order_.Start(sequence, [this](const std::shared_ptr<InboundMessage>& next) {
+            Enqueue(next);
+        });
+    }
+
+    virtual void PostResent(const std::shared_ptr<InboundMessage>& msg) override {
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        Enqueue(msg);
+    }
+
+    virtual void OnReadDone(bool ok) override {
+
+        if (!ok) {
+            // Client has closed its side of the stream
+            LeaveRoom();
+            FinishOnce();
+            return;
+        }
+
+        switch (request_.test_one_of_case()) {
+            case OutboundMessage::TestOneOfCase::kEvent:
+
+                if (request_.event().username().size() > 0) {
+                    //Registration event
+                    SetUserName(request_.event().username());
+                } else {
+                    SayGoodbye();
+                    return;
+                }
+                break;
+
+            case OutboundMessage::TestOneOfCase::kMessage:
+                if (userInChat_ && service_->pipeline().Process(*userName_,
+                    request_.mutable_message()->mutable_message())) {
+                    service_->BroadcastMessage(sessionId_, *userName_, request_.message().message(), this);
+                }
+                break;
+
+            case OutboundMessage::TestOneOfCase::kResend:
+                if (userInChat_) {
+                    service_->Resend(request_.resend().from(), request_.resend().to(), this);
+                }
+                break;
+
+            default:
+                break;
+        }
+
+        StartRead(&request_);
+    }
+
+    virtual void OnWriteDone(bool ok) override {
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        writing_.reset();
+
+        if (ok && !lanes_.empty()) {
+            StartQueuedWrite();
+            return;
+        }
+
+        if (!ok) {
+            // The stream is broken, nothing more is written
+            goodbye_ = true;
+        }
+
+        if (finishDue_ && !finished_) {
+            finished_ = true;
+            Finish(grpc::Status::OK);
+        }
+    }
+
+    virtual void OnCancel() override {
+        LeaveRoom();
+    }
+
+    virtual void OnDone() override {
+        LeaveRoom();
+        service_->admission().Release();
+        delete this;
+    }
+
+private:
+
+    void SetUserName(const std::string& userName) {
+
+        LeaveRoom();
+        userName_ = service_->EnterRoom(userName, sessionId_, this);
+        userInChat_ = true;
+    }
+
+    // Runs on the reading thread and from OnCancel; the room waits for the
+    // broadcasts still posting to this reactor, which take mutex_, so the
+    // exchange keeps mutex_ out of it
+    void LeaveRoom() {
+        if (userInChat_.exchange(false)) {
+            service_->LeaveRoom(sessionId_);
+        }
+    }
+
+    void SayGoodbye() {
+
+        LeaveRoom();
+
+        std::ostringstream s;
+        s << "Good bye, " << (userName_ ? *userName_ : "???") << ".";
+        auto msg = std::make_shared<InboundMessage>();
+        msg->mutable_message()->set_message(s.str());
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        goodbye_ = true;
+        finishDue_ = true;
+        lanes_.Push(msg);
+        lanes_.DropData();
+        if (!writing_) {
+            StartQueuedWrite();
+        }
+    }
+
+    // Queues msg in its lane; the caller holds mutex_
+    void Enqueue(const std::shared_ptr<InboundMessage>& msg) {
+
+        if (goodbye_) {
+            return; // refuse to send messages after goodbye
+        }
+
+        lanes_.Push(msg);
+        if (!writing_) {
+            StartQueuedWrite();
+        }
+    }
+
+    void StartQueuedWrite() {
+        writing_ = lanes_.Pop();
+        StartWrite(writing_.get(), service_->compression().WriteOptionsFor(writing_->ByteSizeLong()));
+    }
+
+    // Finishes after the queued writes unless a goodbye does it already
+    void FinishOnce() {
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (finishDue_) {
+            return;
+        }
+        goodbye_ = true;
+        finishDue_ = true;
+        if (!writing_) {
+            finished_ = true;
+            Finish(grpc::Status::OK);
+        }
+    }
+
+    ChatRoomCallbackService* service_;
+    int sessionId_;
+    std::atomic<bool> userInChat_;
+    InternedName userName_;     // shared with the room, reading thread only
+    OutboundMessage request_;
+
+    std::mutex mutex_;
+    SequenceOrder order_;
+    OutboundLanes lanes_;
+    // The message in flight, StartWrite does not copy it
+    std::shared_ptr<InboundMessage> writing_;
+    bool goodbye_;      // refuses further posts
+    bool finishDue_;    // finish once the write in flight is done
+    bool finished_;
+};
+
+
+// Finishes a stream that was refused: a chat stream not admitted, a relay
+// call without the token
+template <typename Request, typename Response>
+class RejectedReactor : public grpc::ServerBidiReactor<Request, Response> {
+public:
+
+    explicit RejectedReactor(const grpc::Status& status) {
+        this->Finish(status);
+    }
+
+    virtual void OnDone() override {
+        delete this;
+    }
+};
+
+
+// One reactor per peer node streaming its relay batches
+class RelayReactor : public grpc::ServerBidiReactor<chatroom::RelayBatch, chatroom::RelayAck> {
+public:
+
+    RelayReactor(ChatRoomCallbackService* room)
+        : room_(room), streamId_(room->NextSessionId()) {
+        StartRead(&batch_);
+    }
+
+    virtual void OnReadDone(bool ok) override {
+
+        if (!ok) {
+            // Peer is gone unless it has reconnected on a newer stream
+            if (!node_.empty()) {
+                room_->DropNode(node_, streamId_);
+            }
+            Finish(grpc::Status::OK);
+            return;
+        }
+
+        if (!room_->ApplyRelayBatch(batch_, streamId_)) {
+            Finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "too many federation nodes"));
+            return;
+        }
+        node_ = batch_.node();
+        StartRead(&batch_);
+    }
+
+    virtual void OnDone() override {
+        delete this;
+    }
+
+private:
+    ChatRoomCallbackService* room_;
+    int streamId_;
+    std::string node_;
+    chatroom::RelayBatch batch_;
+};
+
+
+grpc::ServerBidiReactor<chatroom::RelayBatch, chatroom::RelayAck>* ChatRelayCallbackService::relay(
+    grpc::CallbackServerContext* context) {
+    if (!RelayTokenMatches(*context, token_)) {
+        return new RejectedReactor<chatroom::RelayBatch, chatroom::RelayAck>(
+            grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "relay token required"));
+    }
+    return new RelayReactor(room_);
+}
+
+
+ChatRoomCallbackService::ChatRoomCallbackService()
+    : fairnessRatio_(OutboundLanes::kDefaultFairnessRatio), nextSessionId_(0), pimpl_(new ChatRoomData()) {
+}
+
+
+grpc::ServerBidiReactor<OutboundMessage, InboundMessage>* ChatRoomCallbackService::chat(
+    grpc::CallbackServerContext* context) {
+    // gRPC owns the threads here, there are no handlers or queues to watch
+    if (!admission_.TryAdmit(0)) {
+        return new RejectedReactor<OutboundMessage, InboundMessage>(admission_.Reject(context));
+    }
+    return new ChatReactor(this, context);
+}
+
+
+grpc::ServerUnaryReactor* ChatRoomCallbackService::listUsers(grpc::CallbackServerContext* context,
+    const ListUsersRequest*, ListUsersResponse* response) {
+
+    std::vector<std::string> list;
+    pimpl_->ListAllUsers(list);
+
+    for(auto &it: list) {
+        response->mutable_usernames()->Add(std::move(it));
+    }
+
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(grpc::Status::OK);
+    return reactor;
+}
+
+
+InternedName ChatRoomCallbackService::EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener) {
+    return pimpl_->EnterRoom(userName, sessionId, listener);
+}
+    
+void ChatRoomCallbackService::LeaveRoom(int sessionId) {
+    pimpl_->LeaveRoom(sessionId);
+}
+
+void ChatRoomCallbackService::BroadcastMessage(int sessionId, const std::string& userName,
+    const std::string& message, EventListenerInterface* sender) {
+    pimpl_->BroadcastMessage(sessionId, userName, message, sender);
+}
+
+void ChatRoomCallbackService::PostNotice(const std::string& message) {
+    pimpl_->PostNotice(message);
+}
+
+void ChatRoomCallbackService::Resend(uint64_t from, uint64_t to, EventListenerInterface* listener) {
+    pimpl_->Resend(from, to, listener);
+}
+
+int ChatRoomCallbackService::NextSessionId() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return nextSessionId_++;
+}
+
+void ChatRoomCallbackService::SetRelay(RoomRelayInterface* relay) {
+    pimpl_->SetRelay(relay);
+}
+
+bool ChatRoomCallbackService::ApplyRelayBatch(const chatroom::RelayBatch& batch, int streamId) {
+    return pimpl_->ApplyRelayBatch(batch, streamId);
+}
+
+void ChatRoomCallbackService::DropNode(const std::string& node, int streamId) {
+    pimpl_->DropNode(node, streamId);
+}
+
+void ChatRoomCallbackService::SetFanOutThreads(int threads, WorkStealingPool::ThreadStart start) {
+    pimpl_->SetFanOutThreads(threads, std::move(start));
+}
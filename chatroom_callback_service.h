@@ -0,0 +1,116 @@
+#ifndef CHATROOM_CALLBACK_SERVICE_H_
+#define CHATROOM_CALLBACK_SERVICE_H_
+
+#include <memory>
+#include <mutex>
+#include <grpcpp/grpcpp.h>
+#include "chatroom_data.h"
+#include "admission_control.h"
+#include "compression_policy.h"
+#include "message_pipeline.h"
+#include "chatroom.grpc.pb.h"
+
+using chatroom::ChatRoom;
+using chatroom::ListUsersRequest;
+using chatroom::ListUsersResponse;
+using chatroom::InboundMessage;
+using chatroom::OutboundMessage;
+
+// ChatRoom implemented with the callback (reactor) API. Reactions run on
+// gRPC's own threads; the shared ChatRoomData synchronizes itself.
+class ChatRoomCallbackService : public ChatRoom::CallbackService {
+public:
+
+    ChatRoomCallbackService();
+
+    virtual grpc::ServerBidiReactor<OutboundMessage, InboundMessage>* chat(
+        grpc::CallbackServerContext* context) override;
+
+    virtual grpc::ServerUnaryReactor* listUsers(grpc::CallbackServerContext* context,
+        const ListUsersRequest* request, ListUsersResponse* response) override;
+
+    InternedName EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener);
+    
+    void LeaveRoom(int sessionId);
+
+    // sender gets the number of the text instead of the text
+    void BroadcastMessage(int sessionId, const std::string& userName, const std::string& message,
+        EventListenerInterface* sender);
+
+    void PostNotice(const std::string& message);
+
+    // Posts the chat text numbered from to to back to listener
+    void Resend(uint64_t from, uint64_t to, EventListenerInterface* listener);
+
+    int NextSessionId();
+
+    void SetRelay(RoomRelayInterface* relay);
+
+    bool ApplyRelayBatch(const chatroom::RelayBatch& batch, int streamId);
+
+    void DropNode(const std::string& node, int streamId);
+
+    void SetFanOutThreads(int threads,
+        WorkStealingPool::ThreadStart start = WorkStealingPool::ThreadStart());
+
+    void SetCompressionPolicy(const CompressionPolicy& compression) {
+        compression_ = compression;
+    }
+
+    const CompressionPolicy& compression() const {
+        return compression_;
+    }
+
+    // Control messages a stream writes in a row while chat text waits
+    void SetFairnessRatio(int ratio) {
+        fairnessRatio_ = ratio;
+    }
+
+    int fairnessRatio() const {
+        return fairnessRatio_;
+    }
+
+    AdmissionControl& admission() {
+        return admission_;
+    }
+
+    // Stages every chat message passes before it is broadcast
+    MessagePipeline& pipeline() {
+        return pipeline_;
+    }
+
+private:
+    CompressionPolicy compression_;
+    AdmissionControl admission_;
+    int fairnessRatio_;
+    MessagePipeline pipeline_;
+    std::mutex mutex_;
+    int nextSessionId_;
+    std::shared_ptr<ChatRoomData> pimpl_;
+};
+
+
+// Receiving half of a federation for the callback API variant
+class ChatRelayCallbackService : public chatroom::ChatRelay::CallbackService {
+public:
+
+    explicit ChatRelayCallbackService(ChatRoomCallbackService* room)
+        : room_(room) {
+    }
+
+    // Relay calls must present token (see RelayTokenMatches); set before
+    // the server starts
+    void SetToken(const std::string& token) {
+        token_ = token;
+    }
+
+    virtual grpc::ServerBidiReactor<chatroom::RelayBatch, chatroom::RelayAck>* relay(
+        grpc::CallbackServerContext* context) override;
+
+private:
+    ChatRoomCallbackService* room_;
+    std::string token_;
+};
+
+
+#endif /* CHATROOM_CALLBACK_SERVICE_H_ */
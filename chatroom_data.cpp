@@ -0,0 +1,405 @@
+#include "chatroom_data.h"
+#include "trace.h"
+#include <algorithm>
+#include <thread>
+
+
+const size_t ChatRoomData::kFanOutChunk;
+const size_t ChatRoomData::kParallelFanOut;
+const size_t ChatRoomData::kResendHistory;
+const size_t ChatRoomData::kMaxRemoteNodes;
+
+// Prefetch the listener this many slots ahead of the one being posted to
+static const size_t kPrefetchDistance = 8;
+
+
+InternedName UserNameTable::Intern(const std::string& name) {
+
+    // Non-owning key for the lookup, nothing is allocated for a known name
+    auto it = names_.find(InternedName(InternedName(), &name));
+    if (it != names_.end()) {
+        return *it;
+    }
+
+    if (names_.size() >= sweepAt_) {
+        Sweep();
+    }
+    InternedName interned = std::make_shared<const std::string>(name);
+    names_.insert(interned);
+    return interned;
+}
+
+void UserNameTable::Sweep() {
+
+    // Only the table can hand out more references, and callers serialize
+    // access to it, so a count of one cannot grow meanwhile
+    for (auto it = names_.begin(); it != names_.end(); ) {
+        if (it->use_count() == 1) {
+            it = names_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    sweepAt_ = std::max<size_t>(64, names_.size() * 2);
+}
+
+
+ChatRoomData::ChatRoomData()
+    : directoryCapacity_(0), directory_(nullptr), slotCount_(0), epoch_(0),
+    relay_(nullptr), sequence_(0), history_(kResendHistory) {
+
+    broadcasts_[0] = 0;
+    broadcasts_[1] = 0;
+}
+
+InternedName ChatRoomData::EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener) {
+
+    InternedName interned;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        interned = names_.Intern(userName);
+
+        auto inserted = sessions_.emplace(std::make_pair(sessionId, SessionInfo(0, interned)));
+        if (!inserted.second) {
+            return inserted.first->second.userName;
+        }
+
+        size_t index = TakeSlot();
+        inserted.first->second.index = index;
+        Slot* const* directory = directory_.load();
+        directory[index / kFanOutChunk][index % kFanOutChunk].store(listener);
+        if (index == slotCount_.load()) {
+            slotCount_.store(index + 1);
+        }
+
+        if (relay_ != nullptr) {
+            relay_->UserEntered(sessionId, userName);
+        }
+    }
+
+    // Read after the slot is filled: a text numbered above it was stamped
+    // after, and its broadcast finds the new listener
+    if (listener != nullptr) {
+        listener->Joined(sequence_.load());
+    }
+    return interned;
+}
+
+void ChatRoomData::LeaveRoom(int sessionId) {
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = sessions_.find(sessionId);
+        if (it == sessions_.end()) {
+            return;
+        }
+
+        FreeSlot(it->second.index);
+        sessions_.erase(it);
+
+        if (relay_ != nullptr) {
+            relay_->UserLeft(sessionId);
+        }
+    }
+
+    // Broadcasts that started before may still have read the listener
+    WaitForBroadcasts();
+}
+
+void ChatRoomData::BroadcastMessage(int sessionId, const std::string& userName, const std::string& message,
+    EventListenerInterface* sender) {
+
+    TRACE_SCOPE(broadcast, sessionId, 0);
+
+    auto  msg = std::make_shared<InboundMessage>();
+    msg->mutable_message()->set_message(message);
+    msg->mutable_message()->set_sender(userName);
+    Stamp(msg);
+
+    FanOut(sessionId, sender, msg);
+
+    if (sender != nullptr) {
+        // The sender does not get its own text back, only its number
+        auto ack = std::make_shared<InboundMessage>();
+        ack->set_sequence(msg->sequence());
+        sender->PostMessage(ack);
+    }
+
+    if (relay_ != nullptr) {
+        relay_->MessagePosted(msg);
+    }
+}
+
+void ChatRoomData::PostNotice(const std::string& message) {
+
+    auto msg = std::make_shared<InboundMessage>();
+    msg->mutable_message()->set_message(message);
+
+    FanOut(-1, nullptr, msg);
+}
+
+void ChatRoomData::Resend(uint64_t from, uint64_t to, EventListenerInterface* listener) {
+
+    uint64_t sequence = sequence_.load();
+    to = std::min(to, sequence);
+    if (from == 0) {
+        from = 1;
+    }
+    if (from > to) {
+        return;
+    }
+
+    uint64_t kept = sequence > kResendHistory ? sequence - kResendHistory + 1 : 1;
+    if (from < kept) {
+        auto msg = std::make_shared<InboundMessage>();
+        msg->mutable_unavailable()->set_from(from);
+        msg->mutable_unavailable()->set_to(std::min(to, kept - 1));
+        listener->PostResent(msg);
+        from = kept;
+    }
+
+    for (uint64_t n = from; n <= to; n++) {
+        // A text numbered but not stored yet is still being broadcast and
+        // reaches the listener that way
+        std::shared_ptr<InboundMessage> msg = std::atomic_load(&history_[n % kResendHistory]);
+        if (msg && msg->sequence() == n) {
+            listener->PostResent(msg);
+        }
+    }
+}
+
+void ChatRoomData::Stamp(const std::shared_ptr<InboundMessage>& msg) {
+
+    uint64_t sequence = sequence_.fetch_add(1) + 1;
+    msg->set_sequence(sequence);
+
+    // A stalled broadcast must not replace the text that took its slot
+    std::shared_ptr<InboundMessage>* slot = &history_[sequence % kResendHistory];
+    std::shared_ptr<InboundMessage> stored = std::atomic_load(slot);
+    while (!stored || stored->sequence() < sequence) {
+        if (std::atomic_compare_exchange_weak(slot, &stored, msg)) {
+            break;
+        }
+    }
+}
+
+void ChatRoomData::FanOut(int senderId, EventListenerInterface* sender, const std::shared_ptr<InboundMessage>& msg) {
+
+    TRACE_SCOPE(fanout, senderId, msg.get());
+
+    size_t counter = EnterBroadcast();
+
+    // The directory is read after the count, it covers every slot counted
+    size_t count = slotCount_.load();
+    Slot* const* directory = directory_.load();
+
+    auto post = [&](size_t begin, size_t end) {
+        while (begin < end) {
+            // One chunk at a time, the chunks are not contiguous
+            size_t base = begin / kFanOutChunk * kFanOutChunk;
+            Slot* chunk = directory[begin / kFanOutChunk];
+            size_t last = std::min(end, base + kFanOutChunk);
+            for (size_t i = begin; i < last; i++) {
+#if defined(__GNUC__)
+                // The slots are read in order; the listeners they point to are not
+                if (i + kPrefetchDistance < last) {
+                    __builtin_prefetch(chunk[i + kPrefetchDistance - base].load(std::memory_order_relaxed));
+                }
+#endif
+                EventListenerInterface* listener = chunk[i - base].load();
+                if (listener != sender && listener != nullptr) {
+                    listener->PostMessage(msg);
+                }
+            }
+            begin = last;
+        }
+    };
+
+    if (fanOutPool_ == nullptr || count < kParallelFanOut) {
+        post(0, count);
+    } else {
+        // Chunks of the pool and of the slots have the same size and bounds
+        fanOutPool_->ParallelFor(count, kFanOutChunk, [&](size_t begin, size_t end) {
+            TRACE_SCOPE(fanout_chunk, senderId, msg.get());
+            post(begin, end);
+        });
+    }
+
+    LeaveBroadcast(counter);
+}
+
+size_t ChatRoomData::TakeSlot() {
+
+    if (!freeSlots_.empty()) {
+        size_t index = *freeSlots_.begin();
+        freeSlots_.erase(freeSlots_.begin());
+        return index;
+    }
+
+    size_t index = slotCount_.load();
+    if (index < chunks_.size() * kFanOutChunk) {
+        return index;
+    }
+
+    chunks_.emplace_back(new Slot[kFanOutChunk]());
+    if (chunks_.size() > directoryCapacity_) {
+        // Broadcasts may still read the old directory, it is kept
+        directoryCapacity_ = std::max<size_t>(4, directoryCapacity_ * 2);
+        std::unique_ptr<Slot*[]> directory(new Slot*[directoryCapacity_]());
+        for (size_t c = 0; c < chunks_.size(); c++) {
+            directory[c] = chunks_[c].get();
+        }
+        directory_.store(directory.get());
+        directories_.push_back(std::move(directory));
+    } else {
+        // Not read before the count covers it
+        directories_.back()[chunks_.size() - 1] = chunks_.back().get();
+    }
+    return index;
+}
+
+void ChatRoomData::FreeSlot(size_t index) {
+
+    Slot* const* directory = directory_.load();
+    directory[index / kFanOutChunk][index % kFanOutChunk].store(nullptr);
+    freeSlots_.insert(index);
+
+    // A broadcast reading the old count finds empty or reused slots beyond
+    // the new one, both are fine
+    size_t count = slotCount_.load();
+    while (count > 0 && !freeSlots_.empty() && *freeSlots_.rbegin() == count - 1) {
+        freeSlots_.erase(count - 1);
+        count--;
+    }
+    slotCount_.store(count);
+}
+
+size_t ChatRoomData::EnterBroadcast() {
+
+    // Counted in the epoch still current after the count, else a new epoch
+    // may have begun waiting without it
+    for (;;) {
+        size_t counter = epoch_.load() & 1;
+        broadcasts_[counter].fetch_add(1);
+        if ((epoch_.load() & 1) == counter) {
+            return counter;
+        }
+        broadcasts_[counter].fetch_sub(1);
+    }
+}
+
+void ChatRoomData::LeaveBroadcast(size_t counter) {
+    broadcasts_[counter].fetch_sub(1);
+}
+
+void ChatRoomData::WaitForBroadcasts() {
+
+    std::lock_guard<std::mutex> lock(epochMutex_);
+
+    // Broadcasts counted from now on read the slots after this point and
+    // see the ones emptied before it
+    size_t counter = epoch_.fetch_add(1) & 1;
+    while (broadcasts_[counter].load() != 0) {
+        std::this_thread::yield();
+    }
+}
+
+void ChatRoomData::SetFanOutThreads(int threads, WorkStealingPool::ThreadStart start) {
+    fanOutPool_.reset(threads > 0 ? new WorkStealingPool(threads, std::move(start)) : nullptr);
+}
+
+void ChatRoomData::ListAllUsers(std::vector<std::string> & list) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    list.clear();
+    for(auto &t : sessions_){
+        list.push_back(*t.second.userName);
+    }
+    for(auto &node : remoteNodes_){
+        for (auto& user : node.second.users) {
+            list.push_back(*user);
+        }
+    }
+}
+
+void ChatRoomData::SetRelay(RoomRelayInterface* relay) {
+    relay_ = relay;
+}
+
+bool ChatRoomData::ApplyRelayBatch(const chatroom::RelayBatch& batch, int streamId) {
+
+    // Fanned out once the users are updated, without the room mutex
+    std::vector<std::string> notices;
+    std::vector<std::shared_ptr<InboundMessage>> texts;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = remoteNodes_.find(batch.node());
+        if (it == remoteNodes_.end()) {
+            if (remoteNodes_.size() >= kMaxRemoteNodes) {
+                return false;
+            }
+            it = remoteNodes_.emplace(batch.node(), RemoteNode()).first;
+        }
+        RemoteNode& node = it->second;
+        node.streamId = streamId;
+
+        std::vector<InternedName>& users = node.users;
+        if (batch.snapshot()) {
+            users.clear();
+        }
+
+        for (auto& event : batch.events()) {
+            switch (event.test_one_of_case()) {
+                case chatroom::RelayEvent::TestOneOfCase::kMembership:
+
+                    if (event.membership().status() == InboundMessage::ConnectionEvent::ENTERED) {
+                        users.push_back(names_.Intern(event.membership().username()));
+                    } else {
+                        const std::string& name = event.membership().username();
+                        auto it = std::find_if(users.begin(), users.end(),
+                            [&](const InternedName& user) { return *user == name; });
+                        if (it != users.end()) {
+                            users.erase(it);
+                        }
+                    }
+                    break;
+
+                case chatroom::RelayEvent::TestOneOfCase::kMessage: {
+                    auto msg = std::make_shared<InboundMessage>();
+                    *msg->mutable_message() = event.message();
+                    texts.push_back(std::move(msg));
+                    break;
+                }
+
+                case chatroom::RelayEvent::TestOneOfCase::kDropped:
+                    notices.push_back(std::to_string(event.dropped()) + " messages from " + batch.node() + " were lost");
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    for (auto& notice : notices) {
+        PostNotice(notice);
+    }
+    for (auto& msg : texts) {
+        // -1 is never a session id, every local session receives it
+        Stamp(msg);
+        FanOut(-1, nullptr, msg);
+    }
+    return true;
+}
+
+void ChatRoomData::DropNode(const std::string& node, int streamId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = remoteNodes_.find(node);
+    if (it != remoteNodes_.end() && it->second.streamId == streamId) {
+        remoteNodes_.erase(it);
+    }
+}
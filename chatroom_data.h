@@ -0,0 +1,245 @@
+#ifndef CHATROOM_DATA_H_
+#define CHATROOM_DATA_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "chatroom.pb.h"
+#include "work_stealing_pool.h"
+
+using chatroom::InboundMessage;
+
+struct EventListenerInterface {
+    
+    // Called once per recipient of a broadcast: take a reference only when
+    // the message has to be kept. Broadcasts run concurrently, so numbered
+    // messages may come out of order (SequenceOrder in outbound_lanes.h)
+    virtual void PostMessage(const std::shared_ptr<InboundMessage>& msg) = 0;
+
+    // Called on entering the room: every text numbered above sequence is
+    // posted, older ones may or may not be
+    virtual void Joined(uint64_t sequence) {
+    }
+
+    // The reply to a resend request, outside the room order
+    virtual void PostResent(const std::shared_ptr<InboundMessage>& msg) {
+        PostMessage(msg);
+    }
+
+};
+
+// Interned user name, one copy however many sessions and rooms hold it
+typedef std::shared_ptr<const std::string> InternedName;
+
+// Interning table. Not synchronized. A name stays while anyone holds it and
+// is dropped by a later sweep once the table holds the only reference.
+class UserNameTable {
+public:
+
+    UserNameTable()
+        : sweepAt_(64) {
+    }
+
+    InternedName Intern(const std::string& name);
+
+    size_t size() const {
+        return names_.size();
+    }
+
+private:
+
+    struct Hash {
+        size_t operator()(const InternedName& name) const {
+            return std::hash<std::string>()(*name);
+        }
+    };
+
+    struct Equal {
+        bool operator()(const InternedName& a, const InternedName& b) const {
+            return *a == *b;
+        }
+    };
+
+    void Sweep();
+
+    std::unordered_set<InternedName, Hash, Equal> names_;
+    size_t sweepAt_;
+};
+
+// Receives the events of local sessions that other nodes need to see
+struct RoomRelayInterface {
+
+    virtual void UserEntered(int sessionId, const std::string& userName) = 0;
+
+    virtual void UserLeft(int sessionId) = 0;
+
+    virtual void MessagePosted(std::shared_ptr<InboundMessage> msg) = 0;
+
+};
+
+// Room membership and fan-out, shared by the completion queue and the
+// callback API services. Thread safe: membership and the users of other
+// nodes are guarded by a mutex of the room, while BroadcastMessage,
+// PostNotice and Resend take no lock and may run on any number of threads
+// at once, alongside a membership change.
+//
+// Fan-out targets are kept in slots of kFanOutChunk listener pointers per
+// chunk. Chunks never move, so a broadcast scans the slots while sessions
+// enter and leave. A leaving session empties its slot, the next one to enter
+// takes the lowest empty slot and empty slots at the end are trimmed, so a
+// broadcast is a linear scan with few holes; the session map is only used to
+// find a session's slot. Every broadcast counts itself in the epoch it
+// started in, and LeaveRoom waits, without the room mutex, for the
+// broadcasts of the epoch before its slot was emptied, so no listener is
+// posted to once LeaveRoom has returned.
+//
+// Rooms of at least kParallelFanOut sessions are fanned out by a pool of
+// worker threads when one is set. Listeners must take posts from any thread,
+// and the workers start the writes themselves: gRPC lets any thread start an
+// operation of a stream, whose completion still comes back to the stream's
+// own queue or reactor, while handing each post to that thread would cost
+// every recipient a queue round trip.
+//
+// In a federation the room also holds the users of the other nodes, as
+// reported by their relay batches. Remote messages are fanned out to local
+// sessions only and never relayed again, so nodes must form a full mesh.
+//
+// Chat text, local or remote, is numbered with an atomic counter (the
+// sequence field of InboundMessage); the sender is told the number of its
+// own text. Concurrent broadcasts reach a listener in any order, the numbers
+// are the room order and each listener restores it. The last kResendHistory
+// texts are kept for resend requests. Numbers are per node: federated nodes
+// number the same room independently.
+class ChatRoomData {
+public:
+
+    ChatRoomData();
+
+    // Returns the interned name, for the session to keep
+    InternedName EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener);
+
+    // Returns once no broadcast posts to the session's listener any more
+    void LeaveRoom(int sessionId);
+
+    // Chat text of userName to every local session but sender, which gets
+    // the number of the text instead; sender may be null
+    void BroadcastMessage(int sessionId, const std::string& userName, const std::string& message,
+        EventListenerInterface* sender);
+
+    // Server notice to every local session, without a sender
+    void PostNotice(const std::string& message);
+
+    // Posts the kept chat text numbered from to to back to listener, and an
+    // Unavailable message for the part of the range no longer kept, through
+    // PostResent
+    void Resend(uint64_t from, uint64_t to, EventListenerInterface* listener);
+
+    // Number of the latest chat text, 0 before the first
+    uint64_t sequence() const {
+        return sequence_.load();
+    }
+
+    void ListAllUsers(std::vector<std::string> & list);
+
+    // Local events are reported to relay, which must outlive the room. Set
+    // before the room is used
+    void SetRelay(RoomRelayInterface* relay);
+
+    // streamId identifies the relay stream the batch arrived on; the latest
+    // stream of a node owns its user list. False, and nothing applied, for
+    // a node beyond the first kMaxRemoteNodes
+    bool ApplyRelayBatch(const chatroom::RelayBatch& batch, int streamId);
+
+    // Forgets the users of a node when its current relay stream has ended
+    void DropNode(const std::string& node, int streamId);
+
+    // Fans out large rooms on threads workers besides the caller, 0: serial.
+    // Each worker runs start first. Set before the room is used
+    void SetFanOutThreads(int threads,
+        WorkStealingPool::ThreadStart start = WorkStealingPool::ThreadStart());
+
+    // Sessions per fan-out chunk and the room size where the pool kicks in
+    static const size_t kFanOutChunk = 1024;
+    static const size_t kParallelFanOut = 4 * kFanOutChunk;
+
+    static const size_t kResendHistory = 1024;
+
+    // Other nodes the room keeps users for at once
+    static const size_t kMaxRemoteNodes = 64;
+
+private:
+
+    typedef std::atomic<EventListenerInterface*> Slot;
+
+    // Numbers chat text and keeps it for resends
+    void Stamp(const std::shared_ptr<InboundMessage>& msg);
+
+    void FanOut(int senderId, EventListenerInterface* sender, const std::shared_ptr<InboundMessage>& msg);
+
+    // A free slot for a new member; mutex_ held
+    size_t TakeSlot();
+
+    // Empties slot index and trims the empty slots at the end; mutex_ held
+    void FreeSlot(size_t index);
+
+    // Counts a broadcast in the current epoch; returns the counter to leave
+    size_t EnterBroadcast();
+
+    void LeaveBroadcast(size_t counter);
+
+    // Starts a new epoch and waits for the broadcasts of the one before
+    void WaitForBroadcasts();
+
+    struct SessionInfo {
+        SessionInfo(size_t index, InternedName userName)
+        : index(index), userName(std::move(userName)) {
+
+        }
+
+        size_t index;   // slot of the session's listener
+        InternedName userName;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<int, SessionInfo> sessions_;
+    // Empty slots below slotCount_
+    std::set<size_t> freeSlots_;
+    // Owns the chunks of slots; directories_ holds every table of chunk
+    // pointers so far, the broadcasts read the latest through directory_
+    std::vector<std::unique_ptr<Slot[]>> chunks_;
+    std::vector<std::unique_ptr<Slot*[]>> directories_;
+    size_t directoryCapacity_;
+    std::atomic<Slot* const*> directory_;
+    std::atomic<size_t> slotCount_;
+    UserNameTable names_;
+
+    // Broadcasts in progress, counted under the parity of their epoch
+    std::atomic<uint64_t> epoch_;
+    std::atomic<long> broadcasts_[2];
+    // One epoch change at a time
+    std::mutex epochMutex_;
+
+    struct RemoteNode {
+        int streamId;
+        std::vector<InternedName> users;
+    };
+
+    std::unordered_map<std::string, RemoteNode> remoteNodes_;
+    RoomRelayInterface* relay_;
+    std::unique_ptr<WorkStealingPool> fanOutPool_;
+
+    std::atomic<uint64_t> sequence_;
+    // Text number n in slot n % kResendHistory, read and replaced with
+    // std::atomic_load and std::atomic_compare_exchange_weak
+    std::vector<std::shared_ptr<InboundMessage>> history_;
+};
+
+
+#endif /* CHATROOM_DATA_H_ */
@@ -0,0 +1,263 @@
+#include "chatroom_federation.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <grpcpp/grpcpp.h>
+
+using chatroom::ChatRelay;
+using chatroom::RelayAck;
+using chatroom::RelayBatch;
+using chatroom::RelayEvent;
+
+
+namespace {
+
+// Events per RelayBatch
+const int kMaxBatch = 256;
+
+// Queued events per peer; past it membership changes give way to a
+// snapshot, then the oldest chat text is dropped and counted
+const size_t kMaxPending = 10000;
+
+const std::chrono::seconds kRetryDelay(1);
+
+}
+
+
+// Relay stream to one peer. All members are guarded by the federation mutex.
+class ChatFederation::Link {
+public:
+
+    Link(ChatFederation* federation, const std::string& peer)
+        : federation_(federation), peer_(peer),
+        stub_(ChatRelay::NewStub(grpc::CreateChannel(peer, grpc::InsecureChannelCredentials()))),
+        dropped_(0), snapshot_(true), stopping_(false), context_(nullptr) {
+
+        thread_ = std::thread(&Link::Run, this);
+    }
+
+    ~Link() {
+        {
+            std::lock_guard<std::mutex> lock(federation_->mutex_);
+            stopping_ = true;
+            if (context_ != nullptr) {
+                context_->TryCancel();
+            }
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    void Push(const std::shared_ptr<const RelayEvent>& event) {
+
+        if (snapshot_ && event->has_membership()) {
+            // The snapshot about to be sent covers it
+            return;
+        }
+
+        if (pending_.size() >= kMaxPending && !snapshot_) {
+            // The peer is not keeping up; a snapshot replaces the queued
+            // membership changes
+            snapshot_ = true;
+            DropMembership();
+            if (event->has_membership()) {
+                return;
+            }
+        }
+
+        if (pending_.size() >= kMaxPending) {
+            // Only chat text is left; the peer is told how much it missed
+            pending_.pop_front();
+            dropped_++;
+        }
+        pending_.push_back(event);
+        ready_.notify_one();
+    }
+
+private:
+
+    void Run() {
+
+        std::unique_lock<std::mutex> lock(federation_->mutex_);
+
+        while (!stopping_) {
+
+            grpc::ClientContext context;
+            // Block the first write until the peer is up instead of failing
+            context.set_wait_for_ready(true);
+            if (!federation_->token_.empty()) {
+                context.AddMetadata(kRelayTokenKey, federation_->token_);
+            }
+            context_ = &context;
+            snapshot_ = true;
+            DropMembership();
+
+            lock.unlock();
+            std::unique_ptr<grpc::ClientReaderWriter<RelayBatch, RelayAck>> stream(stub_->relay(&context));
+            lock.lock();
+
+            RelayBatch batch;
+            bool failed = false;
+            while (NextBatch(lock, &batch)) {
+                lock.unlock();
+                bool ok = stream->Write(batch);
+                lock.lock();
+                if (!ok) {
+                    // Sent again on the next stream, after its snapshot
+                    Requeue(batch);
+                    failed = true;
+                    break;
+                }
+            }
+
+            context_ = nullptr;
+            lock.unlock();
+            if (!failed) {
+                // Stopping; a failed write has ended the call already and
+                // Finish reports why
+                context.TryCancel();
+            }
+            grpc::Status status = stream->Finish();
+            if (status.error_code() == grpc::StatusCode::PERMISSION_DENIED ||
+                status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+                // Retried all the same, the peer may be reconfigured
+                std::cerr << "Relay to " << peer_ << " refused: " << status.error_message() << std::endl;
+            }
+            lock.lock();
+
+            ready_.wait_for(lock, kRetryDelay, [this]() { return stopping_; });
+        }
+    }
+
+    // Waits for events and moves them into batch; false once stopping
+    bool NextBatch(std::unique_lock<std::mutex>& lock, RelayBatch* batch) {
+
+        ready_.wait(lock, [this]() { return stopping_ || snapshot_ || !pending_.empty(); });
+
+        if (stopping_) {
+            return false;
+        }
+
+        batch->Clear();
+        batch->set_node(federation_->node_);
+
+        if (snapshot_) {
+            snapshot_ = false;
+            batch->set_snapshot(true);
+
+            // The snapshot covers the membership changes queued so far
+            DropMembership();
+
+            for (auto& user : federation_->localUsers_) {
+                auto membership = batch->add_events()->mutable_membership();
+                membership->set_username(user.second);
+                membership->set_status(InboundMessage::ConnectionEvent::ENTERED);
+            }
+        }
+
+        if (dropped_ > 0) {
+            batch->add_events()->set_dropped(dropped_);
+            dropped_ = 0;
+        }
+
+        while (!pending_.empty() && batch->events_size() < kMaxBatch) {
+            *batch->add_events() = *pending_.front();
+            pending_.pop_front();
+        }
+        return true;
+    }
+
+    // Puts the chat text of a batch that was not sent back in front of the
+    // queue; its membership is covered by the snapshot of the next stream
+    void Requeue(const RelayBatch& batch) {
+
+        for (int i = batch.events_size() - 1; i >= 0; i--) {
+            const RelayEvent& event = batch.events(i);
+            if (event.has_message()) {
+                if (pending_.size() >= kMaxPending) {
+                    dropped_++;
+                } else {
+                    pending_.push_front(std::make_shared<RelayEvent>(event));
+                }
+            } else if (event.test_one_of_case() == RelayEvent::TestOneOfCase::kDropped) {
+                dropped_ += event.dropped();
+            }
+        }
+    }
+
+    void DropMembership() {
+        pending_.erase(std::remove_if(pending_.begin(), pending_.end(),
+            [](const std::shared_ptr<const RelayEvent>& event) { return event->has_membership(); }),
+            pending_.end());
+    }
+
+    ChatFederation* federation_;
+    std::string peer_;
+    std::unique_ptr<ChatRelay::Stub> stub_;
+    std::condition_variable ready_;
+    std::deque<std::shared_ptr<const RelayEvent>> pending_;
+    uint64_t dropped_;      // chat text not queued, reported to the peer
+    bool snapshot_;
+    bool stopping_;
+    grpc::ClientContext* context_;
+    std::thread thread_;
+};
+
+
+ChatFederation::ChatFederation(const std::string& node, const std::vector<std::string>& peers,
+    const std::string& token)
+    : node_(node), token_(token) {
+
+    for (auto& peer : peers) {
+        links_.emplace_back(new Link(this, peer));
+    }
+}
+
+ChatFederation::~ChatFederation() {
+    links_.clear();
+}
+
+void ChatFederation::UserEntered(int sessionId, const std::string& userName) {
+
+    auto event = std::make_shared<RelayEvent>();
+    event->mutable_membership()->set_username(userName);
+    event->mutable_membership()->set_status(InboundMessage::ConnectionEvent::ENTERED);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    localUsers_[sessionId] = userName;
+    Push(std::move(event));
+}
+
+void ChatFederation::UserLeft(int sessionId) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = localUsers_.find(sessionId);
+    if (it == localUsers_.end()) {
+        return;
+    }
+
+    auto event = std::make_shared<RelayEvent>();
+    event->mutable_membership()->set_username(it->second);
+    event->mutable_membership()->set_status(InboundMessage::ConnectionEvent::LEFT);
+    localUsers_.erase(it);
+    Push(std::move(event));
+}
+
+void ChatFederation::MessagePosted(std::shared_ptr<InboundMessage> msg) {
+
+    auto event = std::make_shared<RelayEvent>();
+    *event->mutable_message() = msg->message();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Push(std::move(event));
+}
+
+void ChatFederation::Push(std::shared_ptr<const RelayEvent> event) {
+    for (auto& link : links_) {
+        link->Push(event);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef CHATROOM_FEDERATION_H_
+#define CHATROOM_FEDERATION_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "chatroom_data.h"
+#include "chatroom.grpc.pb.h"
+
+// Outbound half of a federation: one ChatRelay stream per peer node carries
+// the events of the local users. Events are queued by whoever owns the room
+// and sent by one thread per peer, which packs everything queued meanwhile
+// into a single RelayBatch. A message is queued once per peer, however many
+// users the peer has.
+//
+// Each stream starts with a snapshot of the local users, so a peer that
+// restarts or reconnects converges without replaying history. Chat text is
+// kept across reconnects, a batch that failed to send included; once
+// kMaxPending events are queued for an unreachable peer, the membership
+// changes give way to the snapshot, then the oldest text is dropped and
+// the peer posts a notice of how many messages it lost.
+class ChatFederation : public RoomRelayInterface {
+public:
+
+    // token, when set, goes with every relay call (see RelayTokenMatches)
+    ChatFederation(const std::string& node, const std::vector<std::string>& peers,
+        const std::string& token);
+
+    ~ChatFederation();
+
+    virtual void UserEntered(int sessionId, const std::string& userName) override;
+
+    virtual void UserLeft(int sessionId) override;
+
+    virtual void MessagePosted(std::shared_ptr<InboundMessage> msg) override;
+
+private:
+
+    class Link;
+
+    void Push(std::shared_ptr<const chatroom::RelayEvent> event);
+
+    std::string node_;
+    std::string token_;
+    std::mutex mutex_;
+    std::unordered_map<int, std::string> localUsers_;
+    std::vector<std::unique_ptr<Link>> links_;
+};
+
+
+// Client metadata entry of the token shared by the nodes of a federation
+const char* const kRelayTokenKey = "relay-token";
+
+// Whether a relay call may change the room: a node started with a token
+// accepts only calls presenting the same one. Compares every byte, so the
+// time taken does not tell how much of a guess was right.
+inline bool RelayTokenMatches(const grpc::ServerContextBase& context, const std::string& token) {
+
+    if (token.empty()) {
+        return true;
+    }
+    auto it = context.client_metadata().find(kRelayTokenKey);
+    if (it == context.client_metadata().end()) {
+        return false;
+    }
+    const grpc::string_ref& value = it->second;
+    unsigned char diff = value.size() != token.size();
+    for (size_t i = 0; i < token.size(); i++) {
+        unsigned char presented = i < value.size() ? value.data()[i] : 0;
+        diff |= presented ^ static_cast<unsigned char>(token[i]);
+    }
+    return diff == 0;
+}
+
+
+#endif /* CHATROOM_FEDERATION_H_ */
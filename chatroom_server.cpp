@@ -4,10 +4,18 @@
 #include "chatroom.grpc.pb.h"
 #include "async_call_handler.h"
 #include "chatroom_service.h"
+#include "chatroom_federation.h"
+
+#include "server_options.h"
+#include "content_filter.h"
+#include "cpu_affinity.h"
+#include "cq_poller.h"
+#include "trace.h"
 
 #include <iostream>
 #include <string>
 #include <atomic>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -24,78 +32,170 @@ using chatroom::ChatRoom;
 class ServerImpl {
 public:
 
+    explicit ServerImpl(const ServerOptions& options)
+        : options_(options), relayService_(&service_) {
+    }
+
     ~ServerImpl() {
+        if (!server_) {
+            return;
+        }
         server_->Shutdown();
-        // Always shutdown the completion queue after the server.
-        cq_->Shutdown();
+        // Always shutdown the completion queues after the server.
+        for (auto& cq : cqs_) {
+            cq->Shutdown();
+        }
     }
 
 
     // There is no shutdown handling in this code.
-    void Run() {
-        std::string server_address("0.0.0.0:50051");
-
+    // False when the server could not be set up
+    bool Run() {
         ServerBuilder builder;
-        // Listen on the given address without any authentication mechanism.
-        builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+        // Listen on every given address, tcp or unix socket, without any
+        // authentication mechanism.
+        AddListeners(options_, &builder);
         // Register "service_" as the instance through which we'll communicate with
         // clients. In this case it corresponds to an *asynchronous* service.
         builder.RegisterService(&service_);
-        // Get hold of the completion queue used for the asynchronous communication
-        // with the gRPC runtime.
-        cq_ = builder.AddCompletionQueue();
+        // Default for every call; streaming calls negotiate their own below
+        builder.SetDefaultCompressionAlgorithm(options_.compression);
+        service_.SetCompressionPolicy(
+            CompressionPolicy(options_.streamCompression, options_.compressionThreshold));
+        // New chat streams beyond these limits are shed
+        service_.admission().SetLimits(options_.admission);
+        // The completion queue threads first, the fan-out workers after them
+        std::vector<CpuPlacement> placement = PlanCpuPlacement(options_.cqThreads + options_.fanOutThreads,
+            options_.pinning, options_.cpus, options_.reservedCpus);
+        service_.SetFanOutThreads(options_.fanOutThreads, PlaceFanOutWorkers(
+            std::vector<CpuPlacement>(placement.begin() + options_.cqThreads, placement.end())));
+        if (options_.fairnessRatio > 0) {
+            service_.SetFairnessRatio(options_.fairnessRatio);
+        }
+        if (options_.readWindow > 0) {
+            service_.SetReadWindow(options_.readWindow);
+        }
+        if (!options_.denyList.empty()) {
+            filter_.reset(new ContentFilter(options_.filterAction));
+            if (!filter_->Load(options_.denyList)) {
+                std::cerr << "Cannot read deny-list " << options_.denyList << std::endl;
+                return false;
+            }
+            // kill -HUP <pid> picks up an edited list
+            filter_->InstallReloadSignal(options_.denyList);
+            service_.pipeline().AddStage(filter_.get());
+        }
+        if (options_.memoryQuota > 0) {
+            grpc::ResourceQuota quota("chatroom");
+            quota.Resize(options_.memoryQuota);
+            builder.SetResourceQuota(quota);
+        }
+        if (!options_.peers.empty()) {
+            // Peer nodes relay their users and messages here
+            if (options_.relayToken.empty()) {
+                std::cerr << "Relay calls are not authenticated, see --relay-token" << std::endl;
+            }
+            relayService_.SetToken(options_.relayToken);
+            builder.RegisterService(&relayService_);
+            federation_.reset(new ChatFederation(options_.node, options_.peers, options_.relayToken));
+            service_.SetRelay(federation_.get());
+        }
+        // Get hold of the completion queues used for the asynchronous communication
+        // with the gRPC runtime, one per polling thread.
+        for (int i = 0; i < options_.cqThreads; i++) {
+            cqs_.push_back(builder.AddCompletionQueue());
+        }
         // Finally assemble the server.
         server_ = builder.BuildAndStart();
-        std::cout << "Server listening on " << server_address << std::endl;
+        if (!server_) {
+            std::cerr << "Cannot listen on " << FormatAddresses(options_) << std::endl;
+            return false;
+        }
+        std::cout << "Server listening on " << FormatAddresses(options_) << std::endl;
+
 
+        // kill -USR1 <pid> writes the trace buffers when built with tracing
+        TRACE_INSTALL_DUMP_SIGNAL("trace.json");
+
+        // Proceed to the server's main loop, on this thread for the first queue.
+        std::vector<std::thread> threads;
+        for (int i = 1; i < options_.cqThreads; i++) {
+            threads.emplace_back(&ServerImpl::HandleRpcs, this, i, placement[i]);
+        }
+        HandleRpcs(0, placement[0]);
 
-        // Register async callback handlers
-        // Proceed to the server's main loop.
-        HandleRpcs();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return true;
     }
 
 
-    void HandleRpcs() {
+    void HandleRpcs(int index, CpuPlacement placement) {
+
+        grpc::ServerCompletionQueue* cq = cqs_[index].get();
 
-        HandlerRegistry registry;
-        std::vector<std::unique_ptr<AsyncCallHandlerInterface>> handlers;
-        service_.BuildAsyncHandlers(&registry, cq_.get());
+        if (!placement.cpus.empty()) {
+            bool ok = ApplyCpuPlacement(placement);
+            std::cout << "Completion queue " << index << " on cpus " << FormatCpuList(placement.cpus)
+                << (ok ? "" : " failed") << std::endl;
+        }
+
+        // Built after the placement: the handlers and their sessions are
+        // allocated by this thread, on its node
+        HandlerRegistry registry(index, options_.cqThreads);
+        service_.BuildAsyncHandlers(&registry, cq);
+        if (!options_.peers.empty()) {
+            relayService_.BuildAsyncHandlers(&registry, cq);
+        }
         
         // Loop
         void* tag;  // uniquely identifies a request.
         bool ok;
-        // Block waiting to read the next event from the completion queue. The
+        // Wait for the next event from the completion queue (see --poll). The
         // event is uniquely identified by its tag.
         // The return value of Next should always be checked. This return value
         // tells us whether there is any kind of event or cq_ is shutting down.
-        while (cq_->Next(&tag, &ok)) {
+        CompletionQueuePoller poller(cq, options_.poll);
+        while (NextEvent(poller, &tag, &ok)) {
             
             // Id assigned by registry  
             int id = reinterpret_cast<intptr_t>(tag);
 
-            if (!ok) {
-                // Call has been cancelled by the client or the connection was lost
-                // Handler cannot make any progress so we unregister it 
-                std::cout << "Tag " << id << " - completion queue did not succeed, unregistering the handler";
-                registry.Unregister(id);
-                continue; 
-            }
-
             AsyncCallHandlerInterface* handler;
             
             if (registry.TryLookupById(id, &handler)) {
-                handler->Proceed();
+                TRACE_SCOPE(proceed, id, ok);
+                if (ok) {
+                    handler->Proceed();
+                } else {
+                    // Cancelled, half-closed by the client, connection lost
+                    // or shutting down; the handler decides what is left
+                    handler->OnFailed();
+                }
             } else {
-                std::cout << "Unknown Tag: " << id;
+                std::cout << "Unknown Tag: " << id << std::endl;
             } 
         }
     }
 
+    // Waits for the next event, spinning or blocking as set by --poll; the
+    // wait shows up as cq_wait in traces
+    bool NextEvent(CompletionQueuePoller& poller, void** tag, bool* ok) {
+        TRACE_SCOPE(cq_wait, 0, 0);
+        return poller.Next(tag, ok);
+    }
+
 
 
 private:
-   std::unique_ptr<ServerCompletionQueue> cq_;
+   ServerOptions options_;
+   std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
+   // Outlives the room that reports to it
+   std::unique_ptr<ChatFederation> federation_;
+   std::unique_ptr<ContentFilter> filter_;
    ChatRoomService service_;
+   ChatRelayService relayService_;
    std::unique_ptr<Server> server_;
 };
 
@@ -103,9 +203,13 @@ private:
 
 
 
-int main(int, char**) {
+int main(int argc, char** argv) {
 
-  ServerImpl server;
-  server.Run();
+  ServerOptions options;
+  if (!ParseServerOptions(argc, argv, &options)) {
+    return 1;
+  }
 
-  return 0;}
+  ServerImpl server(options);
+  return server.Run() ? 0 : 1;
+}
@@ -1,7 +1,12 @@
 #include "chatroom_service.h"
 #include "async_call_handler.h"
+#include "async_method_handler.h"
+#include "chatroom_federation.h"
+#include "outbound_lanes.h"
+#include "trace.h"
+#include <deque>
+#include <mutex>
 #include <vector>
-#include <queue>
 #include <sstream>
 #include <unordered_map>
 
@@ -10,30 +15,63 @@ using namespace chatroom;
 
 class ChatWriteHandler;
 class ChatMessageHandler;
+class ChatProcessHandler;
 
+// The stream of a chat call on a gRPC completion queue, kept in its session
+typedef GrpcServerStream<ChatRoomService, ASYNC_METHOD(&ChatRoomService::Requestchat)> ChatGrpcStream;
 
-// State shared by reader and writer
-class ChatSession : public EventListenerInterface {
+
+// State shared by the reader, its processing stage and the writer. The
+// handlers run on the thread of their completion queue, while messages are
+// posted by whichever thread broadcasts: mutex guards the writer and the
+// writeHandler pointer. A post may start the write on a fan-out worker; the
+// mutex keeps one write in flight and the write completes on the queue of
+// the stream, whose handler takes the mutex as well.
+class ChatSession : public EventListenerInterface,
+                    public std::enable_shared_from_this<ChatSession> {
 
 public:
 
-    ChatSession(ChatRoomService * service, ::grpc::ServerCompletionQueue* cq )
-        :service(service), cq(cq), 
-        context(), 
-        readerWriter(new grpc::ServerAsyncReaderWriter<InboundMessage, OutboundMessage>(&context)) {
+    ChatSession(ChatRoomService * service, ChatStreamFactory* streams )
+        : writeHandler(nullptr), messageHandler(nullptr), processHandler(nullptr),
+        service(service), streams(streams),
+        stream(streams), endOfStream(false), sessionId_(-1), userInChat_(false),
+        admitted_(false) {
+    }
+
+    ~ChatSession() {
+        // The room must not post to a session that is gone
+        if (userInChat_) {
+            LeaveRoom();
+        }
+        if (admitted_) {
+            service->admission().Release();
+        }
+    }
+
+    bool TryAdmit(size_t handlers) {
+        admitted_ = service->admission().TryAdmit(handlers);
+        return admitted_;
     }
 
     void RequestChat( void* tag ) {
 
-        context.AsyncNotifyWhenDone(tag); 
-        service->Requestchat(&context, readerWriter.get(), cq, cq, tag);
+        stream->NotifyWhenDone(tag);
+        stream->RequestCall(nullptr, tag);
     }
 
     void Unregister();
 
+    // Finishes the call once the messages queued for the client are written
+    void Close();
+
     void Init(int sessionId);
 
-    virtual void PostMessage(std::shared_ptr<InboundMessage> msg) override; 
+    virtual void PostMessage(const std::shared_ptr<InboundMessage>& msg) override; 
+
+    virtual void Joined(uint64_t sequence) override;
+
+    virtual void PostResent(const std::shared_ptr<InboundMessage>& msg) override;
 
     void LeaveRoom() {
 
@@ -49,37 +87,60 @@ public:
 
 
         if (!userName.empty()) {
-            userName_  = userName;
-            service->EnterRoom(userName, sessionId_, this);
+            userName_ = service->EnterRoom(userName, sessionId_, this);
             userInChat_ = true;
         }
         else {
-            userName_ = "???";
+            userName_.reset();
         }
     }
 
-     void BroadcastMessage(const std::string& message) {
+     // Runs the message pipeline on message in place, then broadcasts it
+     void BroadcastMessage(std::string* message) {
          
-         if (userInChat_){
-            service->BroadcastMessage(sessionId_, message);
+         if (userInChat_ && service->pipeline().Process(*userName_, message)) {
+            service->BroadcastMessage(sessionId_, *userName_, *message, this);
+         }
+     }
+
+     void Resend(uint64_t from, uint64_t to) {
+         if (userInChat_) {
+             service->Resend(from, to, this);
          }
      }
 
      bool TrySayGoodBye();
 
+     // Acts on a message the client sent
+     void Process(OutboundMessage* msg);
+
+    // Hands msg to the writer; the caller holds the lock
+    void Deliver(const std::shared_ptr<InboundMessage>& msg);
+
     const std::string& UserName() const {
-        return userName_;
+        static const std::string unknown("???");
+        return userName_ ? *userName_ : unknown;
     }
 
-    int sessionId_;
-    bool userInChat_;
-    std::string userName_;
+    // One per connected client, mostly idle: keep it to a single
+    // allocation, the stream included, with the small fields packed at the
+    // end
     ChatWriteHandler* writeHandler;
     ChatMessageHandler* messageHandler;
+    ChatProcessHandler* processHandler;
     ChatRoomService* service;
-    ::grpc::ServerCompletionQueue* cq;
-    grpc::ServerContext context;
-    std::unique_ptr<grpc::ServerAsyncReaderWriter<InboundMessage, OutboundMessage>> readerWriter;
+    ChatStreamFactory* streams;
+    InPlaceStream<OutboundMessage, InboundMessage, sizeof(ChatGrpcStream)> stream;
+    // Read and waiting for the processing stage, oldest first; only while
+    // there are any, an idle session keeps a null pointer
+    std::unique_ptr<std::deque<OutboundMessage>> inbox;
+    SequenceOrder order;    // of the posted messages, guarded by mutex
+    bool endOfStream;       // the client sends nothing more
+    std::mutex mutex;
+    InternedName userName_;     // shared with the room
+    int sessionId_;
+    bool userInChat_;
+    bool admitted_;
 };
 
 
@@ -87,15 +148,18 @@ class ChatWriteHandler : public AsyncCallHandler<ChatWriteHandler> {
  public:
 
      ChatWriteHandler(std::shared_ptr<ChatSession> session)
-     : session_(move(session)), state_(CREATED){
+     : session_(move(session)), state_(CREATED), goodby_(false), closing_(false) {
     }
 
     ~ChatWriteHandler() {
+        std::lock_guard<std::mutex> lock(session_->mutex);
         session_->writeHandler = nullptr;
     }
 
     virtual void Proceed() override {
-        
+
+        std::unique_lock<std::mutex> lock(session_->mutex);
+
         if (state_ == CREATED) {
             // go to idle state
            state_ = IDLE;
@@ -103,23 +167,38 @@ class ChatWriteHandler : public AsyncCallHandler<ChatWriteHandler> {
         } else if (state_ == IDLE) {
             // NOTHING TO DO
         } else if (state_ == WRITING) {
+            TRACE_ASYNC_END(write, Id());
             state_ = IDLE;
             // Writing completed
-            if (!queue_.empty()) {
-                WriteMessage(*queue_.front().get(), queue_.size() == 1 && goodby_);
-                queue_.pop();
+            if (lanes_) {
+                std::shared_ptr<InboundMessage> next = lanes_->Pop();
+                if (lanes_->empty()) {
+                    lanes_.reset();
+                }
+                WriteMessage(*next, goodby_ && !lanes_);
+            } else if (closing_) {
+                FinishCall();
+            }
+            if (state_ == IDLE && session_->messageHandler == nullptr) {
+                // The reader is gone and nothing would wake this writer
+                lock.unlock();
+                Unregister();
             }
         }
         else {
             GPR_ASSERT(state_ == FINISHED);
+            TRACE_ASYNC_END(write, Id());
+            // Unregistering destroys this handler, which takes the lock
+            lock.unlock();
             session_->Unregister();
         }
     }
 
     void SayWelcome() {
-        response_.Clear();
-        response_.mutable_message()->set_message("Welcome to the chat!");
-        WriteMessage(response_, false);
+        // Write() serializes the message, a temporary is enough
+        InboundMessage welcome;
+        welcome.mutable_message()->set_message("Welcome to the chat!");
+        WriteMessage(welcome, false);
     }
 
     void SayGoodbye() {
@@ -129,20 +208,41 @@ class ChatWriteHandler : public AsyncCallHandler<ChatWriteHandler> {
         if (state_ == WRITING || state_ == IDLE) {
             std::ostringstream s;
             s << "Good bye, " << session_->UserName() << ".";
-            response_.Clear();
-            response_.mutable_message()->set_message(s.str());
+            auto goodbye = std::make_shared<InboundMessage>();
+            goodbye->mutable_message()->set_message(s.str());
 
             if (state_ == IDLE) {
-                WriteMessage(response_, true);
+                WriteMessage(*goodbye, true);
             }
             else {
-                queue_.emplace(std::make_shared<InboundMessage>(response_));
+                Enqueue(goodbye);
+                lanes_->DropData();
             } 
 
         }
     } 
 
-    void PostMessage(std::shared_ptr<InboundMessage> msg) {
+    // Finishes the call after the messages already queued and refuses
+    // further ones; the caller holds the session lock
+    void Close() {
+        goodby_ = true;
+        if (state_ == IDLE) {
+            FinishCall();
+        } else if (state_ == WRITING) {
+            closing_ = true;
+        }
+    }
+
+    // Refuses further messages if idle; the caller holds the session lock
+    bool TryClose() {
+        if (state_ == IDLE) {
+            goodby_ = true;
+            return true;
+        }
+        return false;
+    }
+
+    void PostMessage(const std::shared_ptr<InboundMessage>& msg) {
         
         if (goodby_) {
             return; // refuse to send messages after goodby
@@ -150,6 +250,8 @@ class ChatWriteHandler : public AsyncCallHandler<ChatWriteHandler> {
 
         if (state_ == IDLE) {
             WriteMessage(*msg.get(), false);
+        } else if (state_ == WRITING) {
+            Enqueue(msg);
         }
     }
 
@@ -164,48 +266,192 @@ private:
     };
 
 
+    void Enqueue(const std::shared_ptr<InboundMessage>& msg) {
+        if (!lanes_) {
+            lanes_.reset(new OutboundLanes(session_->service->fairnessRatio()));
+        }
+        lanes_->Push(msg);
+    }
+
+    void FinishCall() {
+        GPR_ASSERT(state_ == IDLE);
+        TRACE_ASYNC_BEGIN(write, Id(), 0);
+        state_ = FINISHED;
+        session_->stream->Finish(grpc::Status::OK, Tag());
+    }
+
     void WriteMessage(const InboundMessage & msg, bool last)  {
         GPR_ASSERT(state_ == IDLE);
+        TRACE_SCOPE(write_message, Id(), &msg);
+        TRACE_ASYNC_BEGIN(write, Id(), &msg);
+
+        grpc::WriteOptions options = session_->service->compression().WriteOptionsFor(msg.ByteSizeLong());
 
         if (last) {
             state_ = FINISHED;
-            session_->readerWriter->WriteAndFinish(msg, grpc::WriteOptions(), grpc::Status::OK, Tag());
+            session_->stream->WriteAndFinish(msg, options, grpc::Status::OK, Tag());
         } else {
             state_ = WRITING;
-            session_->readerWriter->Write(msg, Tag());
+            session_->stream->Write(msg, options, Tag());
         }
     }
 
-    std::queue<std::shared_ptr<InboundMessage>> queue_;
-
-    bool goodby_;
+    std::shared_ptr<ChatSession> session_;
+    // Allocated only while messages are waiting for the current write
+    std::unique_ptr<OutboundLanes> lanes_;
     State state_;
-    InboundMessage response_;
+    bool goodby_;
+    bool closing_;      // finish once the write in flight is done
+};
+
+
+// Processing stage of a chat call: acts on the messages in the inbox of
+// the session, in the order they were read. Every batch runs as an event of
+// its own, an alarm due at once, so the reader keeps reading meanwhile and
+// the other calls of the completion queue get their turn between batches.
+class ChatProcessHandler : public AsyncCallHandler<ChatProcessHandler> {
+public:
+
+    explicit ChatProcessHandler(std::shared_ptr<ChatSession> session)
+        : session_(std::move(session)), state_(CREATED) {
+    }
+
+    ~ChatProcessHandler() {
+        session_->processHandler = nullptr;
+    }
+
+    virtual void Proceed() override;
+
+    // Schedules a batch unless one is due
+    void Wake() {
+        if (state_ == IDLE) {
+            state_ = BUSY;
+            session_->stream->Alarm(std::chrono::system_clock::time_point(), Tag());
+        }
+    }
+
+    void ReaderGone() {
+        if (state_ != BUSY) {
+            Unregister();
+        }
+    }
+
+private:
+
+    enum State {
+        CREATED = 0,
+        IDLE = 1,
+        BUSY = 2
+    };
+
     std::shared_ptr<ChatSession> session_;
+    State state_;
 };
 
 
+// Reads the messages of a chat call. Each message goes to the inbox of the
+// session and the next read is started right away, while fewer than the
+// read window of the service are waiting there; the processing stage
+// (ChatProcessHandler) acts on them in order.
 class ChatMessageHandler : public AsyncCallHandler<ChatMessageHandler> {
 public:
-    ChatMessageHandler(ChatRoomService * service, ::grpc::ServerCompletionQueue* cq ) 
-    : session_(new ChatSession(service, cq)), state_(CREATED){
+    ChatMessageHandler(ChatRoomService * service, ChatStreamFactory* streams ) 
+    : request_(), session_(std::make_shared<ChatSession>(service, streams)), state_(CREATED),
+    pending_(0), reading_(false) {
         session_->messageHandler = this;
     }
 
     ~ChatMessageHandler() {
         session_->messageHandler = nullptr;
+
+        // An idle writer gets no more events, it goes with the reader; so
+        // does an idle processing stage, a busy one drains the inbox first
+        if (session_->processHandler != nullptr) {
+            session_->processHandler->ReaderGone();
+        }
+
+        ChatWriteHandler* writer = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(session_->mutex);
+            if (session_->writeHandler != nullptr && session_->writeHandler->TryClose()) {
+                writer = session_->writeHandler;
+            }
+        }
+        if (writer != nullptr) {
+            writer->Unregister();
+        }
     }
 
     virtual void Proceed() override {
+        Completed(true);
+    }
+
+    virtual void OnFailed() override {
+        Completed(false);
+    }
+
+    // Reads on unless the inbox is full or a read is in flight
+    void ResumeReading() {
+        if (state_ == CHATTING && !reading_ &&
+            (!session_->inbox || session_->inbox->size() < static_cast<size_t>(session_->service->readWindow()))) {
+            ReadNext();
+        }
+    }
+
+    // Without a writer the stage ends the call once it has seen the goodbye
+    void Finished() {
+        state_ = FINISHED;
+    }
+
+    // Goes once the completions due on its tag are in, the done
+    // notification last; the stream must outlive them
+    void TryUnregister() {
+        if (pending_ == 0) {
+            Unregister();
+        }
+    }
+
+private:
+
+    void Completed(bool ok) {
+
+        TRACE_SCOPE(chat_proceed, Id(), state_);
+
+        if (state_ != CREATED) {
+            pending_--;
+        }
+
+        if (state_ == PROCESSING && !ok) {
+            // Shutting down: no call, and no done notification either
+            Unregister();
+            return;
+        }
+
+        if (state_ == REJECTED) {
+            // Finish and the done notification share the tag, the call
+            // objects must outlive both
+            state_ = FINISHED;
+            return;
+        }
         
-        if (state_ != CREATED && session_->context.IsCancelled()) {
-            // Stream or  connection is closed by the client
-            session_->Unregister();
+        if (state_ != CREATED && session_->stream->IsCancelled()) {
+            // Stream or  connection is closed by the client. Whatever is
+            // still in flight fails and unregisters its own handler; an idle
+            // writer goes with this one.
+            if (session_->userInChat_) {
+                session_->LeaveRoom();
+            }
+            session_->inbox.reset();
+            state_ = FINISHED;
+            reading_ = false;
+            TryUnregister();
             return;
         }
 
         if (state_ == CREATED) {
             state_ = PROCESSING;
+            // The call and the done notification
+            pending_ = 2;
             session_->RequestChat(Tag());
 
             // instantiate and register writer for the same call
@@ -215,72 +461,163 @@ public:
             state_= CHATTING;
 
             // New call handler
-            registry()->Register(new ChatMessageHandler(session_->service, session_-> cq));
+            registry()->Register(new ChatMessageHandler(session_->service, session_->streams));
+
+            if (!session_->TryAdmit(registry()->Size())) {
+                // Shed before the session costs anything beyond its handlers
+                state_ = REJECTED;
+                pending_++;
+                session_->stream->Finish(session_->service->admission().Reject(&session_->stream->context()), Tag());
+                return;
+            }
+
+            registry()->Register(new ChatProcessHandler(session_));
+
             // Continue listening for the events   
-            session_->readerWriter->Read(&request_, Tag());
+            ReadNext();
 
             session_->Init(Id());
          
+        } else if (state_ == CHATTING && !ok) {
+
+            // The client is done sending: what it sent is processed first,
+            // then the stage finishes the call
+            reading_ = false;
+            state_ = GOODBYE;
+            session_->endOfStream = true;
+            if (session_->processHandler != nullptr) {
+                session_->processHandler->Wake();
+            }
+
         } else if (state_ == CHATTING) {
             
             // message read completed
-            switch(request_.test_one_of_case()) {
-                case OutboundMessage::TestOneOfCase::kEvent:
-
-                    if (request_.event().username().size() > 0) {
-                        //Registration event
-                        session_->SetUserName(request_.event().username());
-                    }
-                    else {
-
-                         state_ = FINISHED;
-
-                         if (session_->TrySayGoodBye()) {
-                            state_ = GOODBYE;
-                            return;    
-                         }
-
-                         session_->context.TryCancel();
-                    }           
-                    break;
-
-                case OutboundMessage::TestOneOfCase::kMessage:
-                    session_->BroadcastMessage(request_.message().message());
-                    break;
-
-                default:
-                    break;
-            };
+            reading_ = false;
+            bool goodbye = request_.has_event() && request_.event().username().empty();
+            if (!session_->inbox) {
+                session_->inbox.reset(new std::deque<OutboundMessage>());
+            }
+            session_->inbox->push_back(std::move(request_));
+            request_.Clear();
+
+            if (goodbye) {
+                // Nothing the client sends after its goodbye is read
+                state_ = GOODBYE;
+            } else {
+                ResumeReading();
+            }
+            if (session_->processHandler != nullptr) {
+                session_->processHandler->Wake();
+            }
 
         } else {
-            GPR_ASSERT(state_ == FINISHED);
-            session_->Unregister();
+            // The done notification of a call that ended normally
+            GPR_ASSERT(state_ == FINISHED || state_ == GOODBYE);
+            TryUnregister();
         } 
 
     } 
 
-private:
-
+    void ReadNext() {
+        reading_ = true;
+        pending_++;
+        session_->stream->Read(&request_, Tag());
+    }
 
     enum State  {
         CREATED = 0,
         PROCESSING = 1,
         CHATTING = 2,
         GOODBYE = 3,
-        FINISHED = 4
+        FINISHED = 4,
+        REJECTED = 5
     };
 
 
     OutboundMessage request_;
-    State state_;
-    grpc::ServerContext context_;
     std::shared_ptr<ChatSession> session_;
+    State state_;
+    int pending_;   // completions still due on Tag()
+    bool reading_;
 };
 
 
+void ChatProcessHandler::Proceed() {
+
+    if (state_ == CREATED) {
+        state_ = IDLE;
+        session_->processHandler = this;
+        return;
+    }
+
+    state_ = IDLE;
+
+    // What is queued now; later messages wait for the next batch
+    for (size_t n = session_->inbox ? session_->inbox->size() : 0; n > 0; n--) {
+        OutboundMessage msg(std::move(session_->inbox->front()));
+        session_->inbox->pop_front();
+        session_->Process(&msg);
+    }
+    if (session_->inbox && session_->inbox->empty()) {
+        session_->inbox.reset();
+    }
+
+    if (session_->messageHandler == nullptr) {
+        // The reader is gone and the inbox drained
+        Unregister();
+        return;
+    }
+
+    if (session_->endOfStream && !session_->inbox) {
+        session_->endOfStream = false;
+        if (session_->userInChat_) {
+            session_->LeaveRoom();
+        }
+        session_->Close();
+    }
+
+    session_->messageHandler->ResumeReading();
+    if (session_->inbox) {
+        Wake();
+    }
+}
+
+void ChatSession::Process(OutboundMessage* msg) {
+
+    switch(msg->test_one_of_case()) {
+        case OutboundMessage::TestOneOfCase::kEvent:
+
+            if (msg->event().username().size() > 0) {
+                //Registration event
+                SetUserName(msg->event().username());
+            }
+            else if (!TrySayGoodBye()) {
+                if (messageHandler != nullptr) {
+                    messageHandler->Finished();
+                }
+                stream->TryCancel();
+            }
+            break;
+
+        case OutboundMessage::TestOneOfCase::kMessage:
+            BroadcastMessage(msg->mutable_message()->mutable_message());
+            break;
+
+        case OutboundMessage::TestOneOfCase::kResend:
+            Resend(msg->resend().from(), msg->resend().to());
+            break;
+
+        default:
+            break;
+    };
+}
+
 
 void ChatSession::Init(int sessionId) {
     sessionId_ = sessionId;
+    // Before the welcome message sends the initial metadata
+    service->compression().ApplyToCall(&stream->context());
+    std::lock_guard<std::mutex> lock(mutex);
     if (writeHandler != nullptr) {
         writeHandler->SayWelcome();
     }
@@ -288,7 +625,10 @@ void ChatSession::Init(int sessionId) {
 }
 
 void ChatSession::Unregister() {
-        
+
+    // The handlers hold this session, the last one would take it along
+    std::shared_ptr<ChatSession> self(shared_from_this());
+
     if (userInChat_) {
         LeaveRoom();
     }
@@ -297,20 +637,51 @@ void ChatSession::Unregister() {
         writeHandler->Unregister();
     }
 
+    // The processing stage goes with the reader
     if (messageHandler) {
-        messageHandler->Unregister();
+        messageHandler->TryUnregister();
     }
 
 }
 
-void ChatSession::PostMessage(std::shared_ptr<InboundMessage> msg) {
+void ChatSession::Close() {
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (writeHandler) {
+        writeHandler->Close();
+    } else {
+        stream->TryCancel();
+    }
+}
+
+void ChatSession::PostMessage(const std::shared_ptr<InboundMessage>& msg) {
+    std::lock_guard<std::mutex> lock(mutex);
+    order.Post(msg, [this](const std::shared_ptr<InboundMessage>& next) {
+        Deliver(next);
+    });
+}
+
+void ChatSession::Joined(uint64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex);
+    order.Start(sequence, [this](const std::shared_ptr<InboundMessage>& next) {
+        Deliver(next);
+    });
+}
+
+void ChatSession::PostResent(const std::shared_ptr<InboundMessage>& msg) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Deliver(msg);
+}
+
+void ChatSession::Deliver(const std::shared_ptr<InboundMessage>& msg) {
     if (writeHandler != nullptr) {
         writeHandler->PostMessage(msg);
     }
 }
 
 bool ChatSession::TrySayGoodBye() {
-    
+
+    std::lock_guard<std::mutex> lock(mutex);
     if (writeHandler) {
         writeHandler->SayGoodbye();
         return true;
@@ -320,129 +691,105 @@ bool ChatSession::TrySayGoodBye() {
     }
 }
 
-class ListUsersHandler: public AsyncCallHandler<ListUsersHandler>{
+class ListUsersHandler : public UnaryCallHandler<ListUsersHandler,
+    ChatRoomService, ASYNC_METHOD(&ChatRoomService::RequestlistUsers)> {
 public:
     ListUsersHandler(ChatRoomService * service, ::grpc::ServerCompletionQueue* cq )
-    : service_(service), cq_(cq), state_(CREATED), context_(), 
-    writer_(new grpc::ServerAsyncResponseWriter<ListUsersResponse>(&context_)) {
-
+    : UnaryCallHandler(service, cq) {
     }
 
-    void Proceed() {
-
-        if (state_ == CREATED) {
-            state_ = PROCESSING;
-            service_->RequestlistUsers(&context_, &request_, writer_.get(), cq_, cq_, Tag());
-        }else if (state_ == PROCESSING) {
-
-            state_ = FINISHED;
-            registry()->Register(new ListUsersHandler(service_, cq_));
-            std::vector<std::string> list;
-            service_->ListAllUsers(list);
+    grpc::Status OnRequest(const ListUsersRequest& request, ListUsersResponse* response) {
 
-            for(auto &it: list) {
-                response_.mutable_usernames()->Add(std::move(it));
-            }
+        std::vector<std::string> list;
+        service()->ListAllUsers(list);
 
-            writer_->Finish(response_, grpc::Status::OK, Tag());
-        } else {
-            GPR_ASSERT(state_ == FINISHED);
-            Unregister();
+        for(auto &it: list) {
+            response->mutable_usernames()->Add(std::move(it));
         }
+        return grpc::Status::OK;
     }
-
-
-    enum State {
-        CREATED = 0,
-        PROCESSING = 1,
-        FINISHED = 2
-    };
-
-private:
-    ::grpc::ServerContext context_;
-    ListUsersResponse response_;
-    ListUsersRequest request_;
-    ChatRoomService* service_;
-    ::grpc::ServerCompletionQueue* cq_;
-    State state_;
-    std::unique_ptr<grpc::ServerAsyncResponseWriter<ListUsersResponse>> writer_;
 };
 
 
 
-void ChatRoomService::BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq) {
-    registry->Register(new ChatMessageHandler(this, cq));
-    registry->Register(new ListUsersHandler(this, cq));
-}
-
-
-class ChatRoomService::ChatRoomData {
+class RelayHandler : public BidiStreamingCallHandler<RelayHandler,
+    ChatRelayService, ASYNC_METHOD(&ChatRelayService::Requestrelay)> {
 public:
+    RelayHandler(ChatRelayService * service, StreamFactory* streams )
+    : BidiStreamingCallHandler(service, streams), authorized_(false) {
+    }
 
-    struct SessionInfo {
-        SessionInfo(const std::string& userName, 
-         EventListenerInterface* listener)
-        : userName(userName),  listener(listener) {
-
+    ~RelayHandler() {
+        // Peer is gone unless it has reconnected on a newer stream
+        if (!node_.empty()) {
+            service()->room()->DropNode(node_, Id());
         }
-
-        EventListenerInterface* listener;
-        std::string userName;
-    };
-
-
-
-    void EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener) {
-        sessions_.emplace(std::make_pair(sessionId,  SessionInfo(userName, listener)));
     }
 
-    void LeaveRoom(int sessionId) {
-        sessions_.erase(sessionId);
+    void OnStart() {
+        authorized_ = RelayTokenMatches(context(), service()->token());
+        if (!authorized_) {
+            Finish(grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "relay token required"));
+        }
     }
 
-    void BroadcastMessage(int sessionId, const std::string& message) {
-        
-
-        auto it = sessions_.find(sessionId);
-
-        if (it == sessions_.end()) {
+    void OnRead(const RelayBatch& batch) {
+        if (!authorized_) {
             return;
         }
-
-        auto  msg = std::make_shared<InboundMessage>();
-        msg->mutable_message()->set_message(message);
-        msg->mutable_message()->set_sender(it->second.userName);
-
-        for(auto& t : sessions_){
-            if (t.first != sessionId && t.second.listener != nullptr) {
-                t.second.listener->PostMessage(msg);
-            }
+        if (!service()->room()->ApplyRelayBatch(batch, Id())) {
+            Finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "too many federation nodes"));
+            return;
         }
+        node_ = batch.node();
     }
 
-    void ListAllUsers(std::vector<std::string> & list) {
+private:
+    std::string node_;
+    bool authorized_;
+};
 
-        list.clear();
-        for(auto &t : sessions_){
-            list.push_back(t.second.userName);
-        }
+
+void ChatRelayService::BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq) {
+    RelayStreamFactory* streams = new GrpcStreamFactory<ChatRelayService,
+        ASYNC_METHOD(&ChatRelayService::Requestrelay)>(this, cq);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streamFactories_.emplace_back(streams);
     }
+    BuildAsyncHandlers(registry, streams);
+}
 
+void ChatRelayService::BuildAsyncHandlers(HandlerRegistry* registry, RelayStreamFactory* streams) {
+    registry->Register(new RelayHandler(this, streams));
+}
 
-private:
 
-    std::unordered_map<int, SessionInfo> sessions_;
+void ChatRoomService::BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq) {
+    ChatStreamFactory* streams = new GrpcStreamFactory<ChatRoomService,
+        ASYNC_METHOD(&ChatRoomService::Requestchat)>(this, cq);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streamFactories_.emplace_back(streams);
+    }
+    BuildAsyncHandlers(registry, streams);
+    registry->Register(new ListUsersHandler(this, cq));
+    admission_.BuildAsyncHandlers(registry, cq);
+}
 
-};
+void ChatRoomService::BuildAsyncHandlers(HandlerRegistry* registry, ChatStreamFactory* streams) {
+    registry->Register(new ChatMessageHandler(this, streams));
+}
 
 
-ChatRoomService::ChatRoomService(): pimpl_(new ChatRoomService::ChatRoomData()) {
+ChatRoomService::ChatRoomService(): pimpl_(new ChatRoomData()),
+    fairnessRatio_(OutboundLanes::kDefaultFairnessRatio), readWindow_(kDefaultReadWindow) {
 
 }
 
 
-void ChatRoomService::EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener) {
-    pimpl_->EnterRoom(userName, sessionId, listener);
+InternedName ChatRoomService::EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener) {
+    return pimpl_->EnterRoom(userName, sessionId, listener);
 }
     
 void ChatRoomService::LeaveRoom(int sessionId) {
@@ -453,7 +800,31 @@ void ChatRoomService::ListAllUsers(std::vector<std::string> & list) {
     pimpl_->ListAllUsers(list);
 } 
 
-void ChatRoomService::BroadcastMessage(int sessionId, const std::string& message) {
-    pimpl_->BroadcastMessage(sessionId, message);
+void ChatRoomService::BroadcastMessage(int sessionId, const std::string& userName, const std::string& message,
+    EventListenerInterface* sender) {
+    pimpl_->BroadcastMessage(sessionId, userName, message, sender);
+}
+
+void ChatRoomService::PostNotice(const std::string& message) {
+    pimpl_->PostNotice(message);
+}
+
+void ChatRoomService::Resend(uint64_t from, uint64_t to, EventListenerInterface* listener) {
+    pimpl_->Resend(from, to, listener);
 }
 
+void ChatRoomService::SetRelay(RoomRelayInterface* relay) {
+    pimpl_->SetRelay(relay);
+}
+
+bool ChatRoomService::ApplyRelayBatch(const chatroom::RelayBatch& batch, int streamId) {
+    return pimpl_->ApplyRelayBatch(batch, streamId);
+}
+
+void ChatRoomService::DropNode(const std::string& node, int streamId) {
+    pimpl_->DropNode(node, streamId);
+}
+
+void ChatRoomService::SetFanOutThreads(int threads, WorkStealingPool::ThreadStart start) {
+    pimpl_->SetFanOutThreads(threads, std::move(start));
+}
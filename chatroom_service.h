@@ -2,8 +2,15 @@
 #define CHATROOM_SERVICE_H_
 
 #include <memory>
+#include <mutex>
+#include <vector>
 #include <grpcpp/grpcpp.h>
 #include "async_call_handler.h"
+#include "async_stream.h"
+#include "admission_control.h"
+#include "chatroom_data.h"
+#include "compression_policy.h"
+#include "message_pipeline.h"
 #include "chatroom.grpc.pb.h"
 
 using chatroom::ChatRoom;
@@ -13,12 +20,13 @@ using chatroom::ListUsersRequest;
 using chatroom::ListUsersResponse;
 using chatroom::InboundMessage;
 
-struct EventListenerInterface {
-    
-    virtual void PostMessage(std::shared_ptr<InboundMessage> msg) = 0;
-
-};
+typedef AsyncServerStreamInterface<chatroom::OutboundMessage, InboundMessage> ChatStream;
+typedef AsyncStreamFactoryInterface<chatroom::OutboundMessage, InboundMessage> ChatStreamFactory;
+typedef AsyncStreamFactoryInterface<chatroom::RelayBatch, chatroom::RelayAck> RelayStreamFactory;
 
+// The room is shared by the handlers of every completion queue thread and
+// synchronizes itself (ChatRoomData); a session lock is never held while
+// calling into the room.
 class ChatRoomService : public  ChatRoom::AsyncService {
 
     // Bail out from handling chat method synchronously
@@ -31,20 +39,120 @@ public:
 
     ChatRoomService();
 
-    void EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener);
+    InternedName EnterRoom(const std::string& userName, int sessionId, EventListenerInterface* listener);
     
     void LeaveRoom(int sessionId);
 
-    void BroadcastMessage(int sessionId, const std::string& message);
+    // sender gets the number of the text instead of the text
+    void BroadcastMessage(int sessionId, const std::string& userName, const std::string& message,
+        EventListenerInterface* sender);
+
+    void PostNotice(const std::string& message);
+
+    // Posts the chat text numbered from to to back to listener
+    void Resend(uint64_t from, uint64_t to, EventListenerInterface* listener);
 
     void BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq);
 
+    // The chat handlers alone, on streams made by streams, e.g. simulated
+    // ones; streams must outlive them
+    void BuildAsyncHandlers(HandlerRegistry* registry, ChatStreamFactory* streams);
+
     void ListAllUsers(std::vector<std::string> & list); 
 
-private:
-    class ChatRoomData;
+    void SetRelay(RoomRelayInterface* relay);
+
+    bool ApplyRelayBatch(const chatroom::RelayBatch& batch, int streamId);
+
+    void DropNode(const std::string& node, int streamId);
+
+    void SetFanOutThreads(int threads,
+        WorkStealingPool::ThreadStart start = WorkStealingPool::ThreadStart());
+
+    void SetCompressionPolicy(const CompressionPolicy& compression) {
+        compression_ = compression;
+    }
+
+    const CompressionPolicy& compression() const {
+        return compression_;
+    }
+
+    // Control messages a stream writes in a row while chat text waits
+    void SetFairnessRatio(int ratio) {
+        fairnessRatio_ = ratio;
+    }
+
+    int fairnessRatio() const {
+        return fairnessRatio_;
+    }
+
+    // Messages of a chat stream read ahead of its processing
+    void SetReadWindow(int window) {
+        readWindow_ = window;
+    }
+
+    int readWindow() const {
+        return readWindow_;
+    }
+
+    static const int kDefaultReadWindow = 8;
 
+    AdmissionControl& admission() {
+        return admission_;
+    }
+
+    // Stages every chat message passes before it is broadcast
+    MessagePipeline& pipeline() {
+        return pipeline_;
+    }
+
+private:
+    std::mutex mutex_;
     std::shared_ptr<ChatRoomData> pimpl_;
+    CompressionPolicy compression_;
+    AdmissionControl admission_;
+    int fairnessRatio_;
+    int readWindow_;
+    MessagePipeline pipeline_;
+    // One per completion queue
+    std::vector<std::unique_ptr<ChatStreamFactory>> streamFactories_;
+};
+
+
+// Receiving half of a federation: applies the batches relayed by peer nodes
+// (see ChatFederation) to the room of a ChatRoomService
+class ChatRelayService : public chatroom::ChatRelay::AsyncService {
+public:
+
+    explicit ChatRelayService(ChatRoomService* room)
+        : room_(room) {
+    }
+
+    void BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq);
+
+    // The relay handler on streams made by streams, e.g. simulated ones;
+    // streams must outlive it
+    void BuildAsyncHandlers(HandlerRegistry* registry, RelayStreamFactory* streams);
+
+    ChatRoomService* room() const {
+        return room_;
+    }
+
+    // Relay calls must present token (see RelayTokenMatches); set before
+    // the handlers are built
+    void SetToken(const std::string& token) {
+        token_ = token;
+    }
+
+    const std::string& token() const {
+        return token_;
+    }
+
+private:
+    ChatRoomService* room_;
+    std::string token_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<RelayStreamFactory>> streamFactories_;
 };
 
 
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Runs the completion queue and callback variants of both services under the
+# same load-client workload and prints one result line per variant.
+#
+# A chat variant that does not deliver every expected message is reported
+# and makes the script exit 1: its rate would not be comparable.
+#
+# usage: compare_servers.sh [build dir] [chat clients] [messages] [message size] [greeter calls] [greetings] [concurrency]
+
+BUILD=${1:-build}
+CLIENTS=${2:-10}
+MESSAGES=${3:-1000}
+SIZE=${4:-64}
+CALLS=${5:-1000}
+GREETINGS=${6:-10}
+CONCURRENCY=${7:-8}
+ADDRESS=localhost:50051
+STATUS=0
+
+run() {
+    server=$1
+    shift
+    "$BUILD/$server" > /dev/null &
+    pid=$!
+    sleep 1
+    result=$("$BUILD/load-client" "$@")
+    echo "variant=$server $result"
+    expected=$(echo "$result" | sed -n 's/.* expected=\([0-9]*\).*/\1/p')
+    delivered=$(echo "$result" | sed -n 's/.* delivered=\([0-9]*\).*/\1/p')
+    if [ -n "$expected" ] && [ "$expected" != "$delivered" ]; then
+        echo "variant=$server delivered $delivered of $expected messages" >&2
+        STATUS=1
+    fi
+    kill $pid
+    wait $pid 2> /dev/null || true
+}
+
+run chatroom-server chat $ADDRESS $CLIENTS $MESSAGES $SIZE
+run chatroom-server-callback chat $ADDRESS $CLIENTS $MESSAGES $SIZE
+run helloworld-streaming-server greeter $ADDRESS $CALLS $GREETINGS $CONCURRENCY
+run helloworld-streaming-server-callback greeter $ADDRESS $CALLS $GREETINGS $CONCURRENCY
+
+exit $STATUS
@@ -0,0 +1,55 @@
+#ifndef SRC_COMPRESSION_POLICY_H_
+#define SRC_COMPRESSION_POLICY_H_
+
+#include <cstddef>
+#include <grpcpp/grpcpp.h>
+
+// Compression of streaming responses, decided per call and per message.
+//
+// A call asks for a compression level rather than an algorithm; gRPC maps
+// the level to an algorithm the client listed in grpc-accept-encoding, so
+// clients that cannot decompress get plain messages. Messages smaller than
+// the threshold are sent uncompressed, compressing them costs more CPU than
+// the bytes it saves.
+class CompressionPolicy {
+public:
+
+    CompressionPolicy()
+        : level_(GRPC_COMPRESS_LEVEL_NONE), threshold_(0) {
+    }
+
+    CompressionPolicy(grpc_compression_level level, size_t threshold)
+        : level_(level), threshold_(threshold) {
+    }
+
+    // Must be called before the initial metadata is sent
+    void ApplyToCall(grpc::ServerContextBase* context) const {
+        if (level_ != GRPC_COMPRESS_LEVEL_NONE) {
+            context->set_compression_level(level_);
+        }
+    }
+
+    // Options for a message of byteSize serialized bytes
+    grpc::WriteOptions WriteOptionsFor(size_t byteSize) const {
+        grpc::WriteOptions options;
+        if (byteSize < threshold_) {
+            options.set_no_compression();
+        }
+        return options;
+    }
+
+    grpc_compression_level level() const {
+        return level_;
+    }
+
+    size_t threshold() const {
+        return threshold_;
+    }
+
+private:
+    grpc_compression_level level_;
+    size_t threshold_;
+};
+
+
+#endif /* SRC_COMPRESSION_POLICY_H_ */
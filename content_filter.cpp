@@ -0,0 +1,177 @@
+#include "content_filter.h"
+#include <algorithm>
+#include <csignal>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <thread>
+
+
+namespace {
+
+unsigned char Fold(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+volatile std::sig_atomic_t reloadRequested = 0;
+
+void OnReloadSignal(int) {
+    reloadRequested = 1;
+}
+
+}
+
+
+MultiPatternMatcher::MultiPatternMatcher(const std::vector<std::string>& terms)
+    : classes_(1), terms_(0) {
+
+    // Byte classes
+    uint8_t classOfFolded[256] = {0};
+    for (auto& term : terms) {
+        for (unsigned char c : term) {
+            if (classOfFolded[Fold(c)] == 0) {
+                classOfFolded[Fold(c)] = static_cast<uint8_t>(classes_++);
+            }
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        classOf_[c] = classOfFolded[Fold(static_cast<unsigned char>(c))];
+    }
+
+    // Trie, -1 marks a missing edge
+    next_.assign(classes_, -1);
+    matchLength_.assign(1, 0);
+
+    for (auto& term : terms) {
+        if (term.empty()) {
+            continue;
+        }
+        size_t state = 0;
+        for (unsigned char c : term) {
+            size_t edge = state * classes_ + classOf_[c];
+            if (next_[edge] < 0) {
+                next_[edge] = static_cast<int32_t>(matchLength_.size());
+                matchLength_.push_back(0);
+                next_.resize(next_.size() + classes_, -1);
+            }
+            state = next_[edge];
+        }
+        matchLength_[state] = std::max<uint32_t>(matchLength_[state], term.size());
+        terms_++;
+    }
+
+    // Breadth first, so the failure state of a state is complete before it:
+    // a missing edge takes the edge of the failure state, and a state also
+    // matches what its failure state matches
+    std::vector<int32_t> fail(matchLength_.size(), 0);
+    std::queue<int32_t> pending;
+
+    for (int32_t k = 0; k < classes_; k++) {
+        if (next_[k] < 0) {
+            next_[k] = 0;
+        } else {
+            pending.push(next_[k]);
+        }
+    }
+
+    while (!pending.empty()) {
+        int32_t state = pending.front();
+        pending.pop();
+        matchLength_[state] = std::max(matchLength_[state], matchLength_[fail[state]]);
+
+        for (int32_t k = 0; k < classes_; k++) {
+            int32_t& edge = next_[state * classes_ + k];
+            int32_t viaFail = next_[fail[state] * classes_ + k];
+            if (edge < 0) {
+                edge = viaFail;
+            } else {
+                fail[edge] = viaFail;
+                pending.push(edge);
+            }
+        }
+    }
+}
+
+
+ContentFilter::ContentFilter(FilterAction action)
+    : action_(action), matcher_(std::make_shared<MultiPatternMatcher>(std::vector<std::string>())),
+    matched_(0) {
+}
+
+bool ContentFilter::Load(const std::string& path) {
+
+    std::ifstream in(path.c_str());
+    if (!in) {
+        return false;
+    }
+
+    std::vector<std::string> terms;
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        size_t first = line.find_first_not_of(" \t\r");
+        size_t last = line.find_last_not_of(" \t\r");
+        if (first != std::string::npos) {
+            terms.push_back(line.substr(first, last - first + 1));
+        }
+    }
+    if (in.bad()) {
+        return false;
+    }
+
+    SetTerms(terms);
+    return true;
+}
+
+void ContentFilter::SetTerms(const std::vector<std::string>& terms) {
+    std::shared_ptr<const MultiPatternMatcher> matcher = std::make_shared<MultiPatternMatcher>(terms);
+    std::atomic_store(&matcher_, matcher);
+}
+
+void ContentFilter::InstallReloadSignal(const std::string& path) {
+
+    std::signal(SIGHUP, OnReloadSignal);
+
+    // Loading builds the automaton, keep it out of the signal handler
+    std::thread([this, path]() {
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (reloadRequested) {
+                reloadRequested = 0;
+                if (Load(path)) {
+                    std::cout << "Deny-list reloaded, " << std::atomic_load(&matcher_)->terms()
+                        << " terms" << std::endl;
+                } else {
+                    std::cerr << "Cannot read deny-list " << path << ", keeping the current one" << std::endl;
+                }
+            }
+        }
+    }).detach();
+}
+
+bool ContentFilter::Process(const std::string& sender, std::string* message) {
+
+    std::shared_ptr<const MultiPatternMatcher> matcher = std::atomic_load(&matcher_);
+    bool found = false;
+
+    if (action_ == FILTER_MASK) {
+        // Bytes before the scan position only, the rest is still read
+        matcher->Scan(*message, [&](size_t begin, size_t end) {
+            found = true;
+            std::fill(message->begin() + begin, message->begin() + end, '*');
+        });
+    } else {
+        matcher->Scan(*message, [&](size_t, size_t) { found = true; });
+    }
+
+    if (!found) {
+        return true;
+    }
+
+    matched_.fetch_add(1);
+    if (action_ == FILTER_FLAG) {
+        std::cout << "Flagged message from " << sender << std::endl;
+    }
+    return action_ != FILTER_DROP;
+}
@@ -0,0 +1,100 @@
+#ifndef SRC_CONTENT_FILTER_H_
+#define SRC_CONTENT_FILTER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "message_pipeline.h"
+
+// Aho-Corasick automaton over a deny-list, matching every term in a single
+// pass over the text. ASCII letters match regardless of case.
+//
+// The automaton is a full DFA over byte classes: bytes that occur in no term
+// share class 0, every other (case folded) byte gets a class of its own, so
+// a step is one table lookup and the table stays terms x alphabet small.
+class MultiPatternMatcher {
+public:
+
+    explicit MultiPatternMatcher(const std::vector<std::string>& terms);
+
+    // Calls onMatch(begin, end) at every position where a term ends, with
+    // the longest such term; shorter ones lie inside it
+    template <typename F>
+    void Scan(const std::string& text, F onMatch) const {
+
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(text.data());
+        size_t size = text.size();
+        int32_t state = 0;
+
+        for (size_t i = 0; i < size; i++) {
+            if (state == 0) {
+                // Nothing can start at bytes outside every term
+                while (i < size && classOf_[data[i]] == 0) {
+                    i++;
+                }
+                if (i == size) {
+                    break;
+                }
+            }
+            state = next_[state * classes_ + classOf_[data[i]]];
+            if (matchLength_[state] > 0) {
+                onMatch(i + 1 - matchLength_[state], i + 1);
+            }
+        }
+    }
+
+    size_t terms() const {
+        return terms_;
+    }
+
+    size_t states() const {
+        return matchLength_.size();
+    }
+
+private:
+    uint8_t classOf_[256];
+    int32_t classes_;
+    size_t terms_;
+    std::vector<int32_t> next_;
+    std::vector<uint32_t> matchLength_;
+};
+
+
+enum FilterAction {
+    FILTER_DROP = 0,    // the message is not broadcast
+    FILTER_MASK = 1,    // matched terms are replaced with '*'
+    FILTER_FLAG = 2     // broadcast unchanged and logged for moderation
+};
+
+// Message stage screening chat text against a deny-list file, one term per
+// line, '#' starts a comment. The list is swapped atomically on reload, so
+// messages in flight finish with the list they started with.
+class ContentFilter : public MessageStageInterface {
+public:
+
+    explicit ContentFilter(FilterAction action);
+
+    // Replaces the deny-list; on failure the current one stays
+    bool Load(const std::string& path);
+
+    void SetTerms(const std::vector<std::string>& terms);
+
+    // SIGHUP reloads the file; the filter must live until exit
+    void InstallReloadSignal(const std::string& path);
+
+    virtual bool Process(const std::string& sender, std::string* message) override;
+
+    int64_t matched() const {
+        return matched_.load();
+    }
+
+private:
+    FilterAction action_;
+    std::shared_ptr<const MultiPatternMatcher> matcher_;
+    std::atomic<int64_t> matched_;
+};
+
+
+#endif /* SRC_CONTENT_FILTER_H_ */
@@ -0,0 +1,207 @@
+#include "cpu_affinity.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+
+bool ParseCpuList(const std::string& text, std::vector<int>* cpus) {
+
+    std::istringstream is(text);
+    std::string range;
+
+    while (std::getline(is, range, ',')) {
+        if (range.empty()) {
+            continue;
+        }
+        char* end = nullptr;
+        long first = std::strtol(range.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-') {
+            last = std::strtol(end + 1, &end, 10);
+        }
+        if (*end != '\0' && *end != '\n') {
+            return false;
+        }
+        if (first < 0 || last < first) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus->push_back(static_cast<int>(cpu));
+        }
+    }
+
+    std::sort(cpus->begin(), cpus->end());
+    cpus->erase(std::unique(cpus->begin(), cpus->end()), cpus->end());
+    return true;
+}
+
+
+std::string FormatCpuList(const std::vector<int>& cpus) {
+
+    std::ostringstream os;
+    for (size_t i = 0; i < cpus.size(); i++) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            j++;
+        }
+        os << (i > 0 ? "," : "") << cpus[i];
+        if (j > i) {
+            os << "-" << cpus[j];
+        }
+        i = j;
+    }
+    return os.str();
+}
+
+
+#ifdef __linux__
+
+// cpu -> node, read from sysfs once
+static const std::map<int, int>& NodeOfCpu() {
+
+    static std::map<int, int>* nodes = nullptr;
+    if (nodes != nullptr) {
+        return *nodes;
+    }
+    nodes = new std::map<int, int>();
+
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir == nullptr) {
+        return *nodes;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name(entry->d_name);
+        if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+        std::ifstream in("/sys/devices/system/node/" + name + "/cpulist");
+        std::string list;
+        std::vector<int> cpus;
+        if (std::getline(in, list) && ParseCpuList(list, &cpus)) {
+            for (int cpu : cpus) {
+                (*nodes)[cpu] = std::atoi(name.c_str() + 4);
+            }
+        }
+    }
+    closedir(dir);
+    return *nodes;
+}
+
+
+int CpuNode(int cpu) {
+    auto& nodes = NodeOfCpu();
+    auto it = nodes.find(cpu);
+    return it == nodes.end() ? 0 : it->second;
+}
+
+
+std::vector<int> AllowedCpus() {
+
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+
+bool ApplyCpuPlacement(const CpuPlacement& placement) {
+
+    bool ok = true;
+
+    if (!placement.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : placement.cpus) {
+            if (cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        ok = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    if (placement.node >= 0 && placement.node < 63) {
+        // Per thread policy: new pages come from the node while it has memory
+        unsigned long mask = 1UL << placement.node;
+        ok = syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) == 0 && ok;
+    }
+    return ok;
+}
+
+#else
+
+int CpuNode(int) {
+    return 0;
+}
+
+std::vector<int> AllowedCpus() {
+    return std::vector<int>();
+}
+
+bool ApplyCpuPlacement(const CpuPlacement&) {
+    return true;
+}
+
+#endif
+
+
+std::vector<CpuPlacement> PlanCpuPlacement(int threads, CpuPinning pinning,
+    const std::vector<int>& cpus, const std::vector<int>& reserved) {
+
+    std::vector<CpuPlacement> plan(threads);
+
+    if (pinning == PIN_NONE && cpus.empty() && reserved.empty()) {
+        return plan;
+    }
+
+    std::vector<int> usable;
+    for (int cpu : cpus.empty() ? AllowedCpus() : cpus) {
+        if (std::find(reserved.begin(), reserved.end(), cpu) == reserved.end()) {
+            usable.push_back(cpu);
+        }
+    }
+    if (usable.empty()) {
+        return plan;
+    }
+
+    // The set's cpus grouped by node
+    std::map<int, std::vector<int>> byNode;
+    for (int cpu : usable) {
+        byNode[CpuNode(cpu)].push_back(cpu);
+    }
+    std::vector<std::pair<int, std::vector<int>>> nodes(byNode.begin(), byNode.end());
+
+    for (int i = 0; i < threads; i++) {
+        if (pinning == PIN_CORE) {
+            // Spread over the nodes first, then over their cpus
+            auto& node = nodes[i % nodes.size()];
+            plan[i].cpus.push_back(node.second[(i / nodes.size()) % node.second.size()]);
+            plan[i].node = node.first;
+        } else if (pinning == PIN_NODE) {
+            auto& node = nodes[i % nodes.size()];
+            plan[i].cpus = node.second;
+            plan[i].node = node.first;
+        } else {
+            plan[i].cpus = usable;
+        }
+    }
+    return plan;
+}
@@ -0,0 +1,48 @@
+#ifndef SRC_CPU_AFFINITY_H_
+#define SRC_CPU_AFFINITY_H_
+
+#include <string>
+#include <vector>
+
+// Placement of completion queue threads on cpus and NUMA nodes.
+//
+// A thread that is pinned also prefers its node for memory, so the handlers
+// and sessions it allocates while serving its queue stay local to it.
+// Linux only; elsewhere the plan is empty and applying it does nothing.
+
+enum CpuPinning {
+    PIN_NONE = 0,   // every thread may use the whole cpu set
+    PIN_CORE = 1,   // one cpu per thread, round robin over the set
+    PIN_NODE = 2    // the set's cpus of one NUMA node, nodes round robin
+};
+
+struct CpuPlacement {
+    CpuPlacement()
+        : node(-1) {
+    }
+
+    std::vector<int> cpus;  // empty: affinity left alone
+    int node;               // preferred node for allocations, -1: none
+};
+
+// Parses a cpu list such as "0-3,8,10-11"
+bool ParseCpuList(const std::string& text, std::vector<int>* cpus);
+
+std::string FormatCpuList(const std::vector<int>& cpus);
+
+// NUMA node of cpu, 0 when unknown
+int CpuNode(int cpu);
+
+// Cpus the process may run on
+std::vector<int> AllowedCpus();
+
+// Placement for each of threads queue threads. An empty cpus means the
+// allowed cpus; reserved cpus are never used.
+std::vector<CpuPlacement> PlanCpuPlacement(int threads, CpuPinning pinning,
+    const std::vector<int>& cpus, const std::vector<int>& reserved);
+
+// Applies placement to the calling thread
+bool ApplyCpuPlacement(const CpuPlacement& placement);
+
+
+#endif /* SRC_CPU_AFFINITY_H_ */
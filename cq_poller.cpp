@@ -0,0 +1,57 @@
+#include "cq_poller.h"
+#include <algorithm>
+#include <thread>
+#include <grpc/support/time.h>
+#include <grpcpp/grpcpp.h>
+
+
+CompletionQueuePoller::CompletionQueuePoller(grpc::CompletionQueue* cq, const PollSettings& settings)
+    : cq_(cq), settings_(settings), budget_(settings.spin), averageWait_(0),
+    spinHits_(0), blocks_(0) {
+}
+
+bool CompletionQueuePoller::Next(void** tag, bool* ok) {
+
+    if (settings_.mode == POLL_BLOCK) {
+        return cq_->Next(tag, ok);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (budget_.count() > 0) {
+        auto until = start + budget_;
+        // Checks the queue and polls its I/O once, without sleeping
+        gpr_timespec past = gpr_inf_past(GPR_CLOCK_MONOTONIC);
+        do {
+            switch (cq_->AsyncNext(tag, ok, past)) {
+                case grpc::CompletionQueue::GOT_EVENT:
+                    spinHits_++;
+                    Adapt(std::chrono::steady_clock::now() - start);
+                    return true;
+                case grpc::CompletionQueue::SHUTDOWN:
+                    return false;
+                case grpc::CompletionQueue::TIMEOUT:
+                    break;
+            }
+            // Lets a thread that would produce the event run on this cpu
+            std::this_thread::yield();
+        } while (std::chrono::steady_clock::now() < until);
+    }
+
+    blocks_++;
+    bool got = cq_->Next(tag, ok);
+    Adapt(std::chrono::steady_clock::now() - start);
+    return got;
+}
+
+void CompletionQueuePoller::Adapt(std::chrono::nanoseconds waited) {
+
+    if (settings_.mode != POLL_ADAPTIVE) {
+        return;
+    }
+
+    averageWait_ = (averageWait_ * 7 + waited) / 8;
+
+    std::chrono::nanoseconds cap = settings_.spin;
+    budget_ = averageWait_ <= cap ? std::min(averageWait_ * 2, cap) : std::chrono::nanoseconds(0);
+}
@@ -0,0 +1,71 @@
+#ifndef SRC_CQ_POLLER_H_
+#define SRC_CQ_POLLER_H_
+
+#include <chrono>
+#include <cstdint>
+
+namespace grpc {
+class CompletionQueue;
+}
+
+enum PollMode {
+    POLL_BLOCK = 0,     // Next() only
+    POLL_SPIN = 1,      // spin for the whole budget, then block
+    POLL_ADAPTIVE = 2   // spin for a budget tuned to the recent event rate
+};
+
+struct PollSettings {
+
+    PollSettings()
+        : mode(POLL_BLOCK), spin(50) {
+    }
+
+    PollMode mode;
+    std::chrono::microseconds spin;     // spin budget, the cap in adaptive mode
+};
+
+
+// Takes the events of one completion queue for its polling thread.
+//
+// A thread blocked in Next() pays a futex wake-up for every event. Polling
+// AsyncNext with a deadline in the past first also drives the I/O of the
+// queue, so events arriving within the spin budget are taken without
+// sleeping, at the price of the cpu time spent spinning. When the budget
+// runs out the poller blocks as before.
+//
+// The adaptive mode keeps an average of how long the thread waited for its
+// recent events and spins only while that average fits in the budget, for
+// about twice as long; at low rates it blocks right away and idles as cheaply
+// as POLL_BLOCK. Not thread safe, one poller per polling thread.
+class CompletionQueuePoller {
+public:
+
+    CompletionQueuePoller(grpc::CompletionQueue* cq, const PollSettings& settings);
+
+    // As grpc::CompletionQueue::Next
+    bool Next(void** tag, bool* ok);
+
+    // Events taken while spinning
+    uint64_t spinHits() const {
+        return spinHits_;
+    }
+
+    // Events waited for in Next()
+    uint64_t blocks() const {
+        return blocks_;
+    }
+
+private:
+
+    void Adapt(std::chrono::nanoseconds waited);
+
+    grpc::CompletionQueue* cq_;
+    PollSettings settings_;
+    std::chrono::nanoseconds budget_;
+    std::chrono::nanoseconds averageWait_;
+    uint64_t spinHits_;
+    uint64_t blocks_;
+};
+
+
+#endif /* SRC_CQ_POLLER_H_ */
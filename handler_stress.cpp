@@ -0,0 +1,276 @@
+// Drives the async stream handlers through HandlerRegistry on a
+// SimulatedCompletionQueue: no network, completions delivered in a random
+// order drawn from a seed, clients that cancel, half-close and lose writes.
+// Every run ends with a shutdown and checks that nothing is left behind:
+// handlers, streams, admitted sessions and room members. One JSON object is
+// printed per run; the checksum of the delivered (tag, ok) sequence is equal
+// for equal seeds, so a failing seed replays exactly.
+//
+//   chat      ChatRoomService chat calls; clients register, post text, ask
+//             for resends and now and then say goodbye.
+//   greeter   MultiGreeterService sayHello calls with 1 to 8 greetings and
+//             some pauses.
+//   relay     ChatRelayService relay calls of one peer node, sending
+//             snapshots, membership changes and chat text.
+//
+// usage: handler-stress [key=value...]
+//   services=chat,greeter,relay   seed=1   runs=1   events=1000000
+//   open-calls=64   cancel=0.001   write-fail=0.001   half-close=0.01
+//
+// Exits 1 when a run breaks the stream rules or leaks.
+
+#include "async_call_handler.h"
+#include "chatroom_service.h"
+#include "multi_greeter_service.h"
+#include "simulated_completion_queue.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using chatroom::OutboundMessage;
+using chatroom::RelayAck;
+using chatroom::RelayBatch;
+using hellostreamingworld::HelloReply;
+using hellostreamingworld::HelloRequest;
+
+
+struct RunResult {
+
+    RunResult()
+        : handlers(0), sessions(0), members(0), seconds(0) {
+    }
+
+    size_t handlers;    // left in the registry
+    int sessions;       // left admitted
+    size_t members;     // left in the room
+    double seconds;
+};
+
+
+// Serves the queue like the servers serve a completion queue and shuts it
+// down after events completions
+static void Serve(HandlerRegistry& registry, SimulatedCompletionQueue& queue, uint64_t events) {
+
+    void* tag;
+    bool ok;
+    while (queue.Next(&tag, &ok)) {
+        int id = static_cast<int>(reinterpret_cast<intptr_t>(tag));
+        AsyncCallHandlerInterface* handler;
+        if (!registry.TryLookupById(id, &handler)) {
+            // A failed alarm of a stream that is gone is expected
+            if (ok) {
+                queue.Violation("completion for a handler that is gone");
+            }
+        } else if (ok) {
+            handler->Proceed();
+        } else {
+            handler->OnFailed();
+        }
+        if (queue.events() == events) {
+            queue.Shutdown();
+        }
+    }
+}
+
+static void ChatClient(OutboundMessage* msg, std::mt19937_64& random) {
+
+    msg->Clear();
+    uint64_t r = random() % 100;
+    if (r < 10) {
+        msg->mutable_event()->set_username("user" + std::to_string(random() % 32));
+    } else if (r < 12) {
+        // Goodbye
+        msg->mutable_event();
+    } else if (r < 15) {
+        uint64_t from = random() % 2048;
+        msg->mutable_resend()->set_from(from);
+        msg->mutable_resend()->set_to(from + random() % 16);
+    } else {
+        msg->mutable_message()->set_message("hello " + std::to_string(r));
+    }
+}
+
+static void GreeterClient(HelloRequest* request, std::mt19937_64& random) {
+
+    request->set_name("sim");
+    request->set_num_greetings(1 + static_cast<int>(random() % 8));
+    request->set_pauseinmilliseconds(random() % 4 == 0 ? 5 : 0);
+}
+
+static void RelayClient(RelayBatch* batch, std::mt19937_64& random) {
+
+    // One peer reconnecting, as a node keeps its name across its streams
+    batch->Clear();
+    batch->set_node("peer");
+    batch->set_snapshot(random() % 8 == 0);
+    for (int i = static_cast<int>(random() % 4); i > 0; i--) {
+        chatroom::RelayEvent* event = batch->add_events();
+        uint64_t r = random() % 100;
+        if (r < 50) {
+            event->mutable_membership()->set_username("user" + std::to_string(random() % 32));
+            event->mutable_membership()->set_status(r < 30 ?
+                chatroom::InboundMessage::ConnectionEvent::ENTERED : chatroom::InboundMessage::ConnectionEvent::LEFT);
+        } else {
+            event->mutable_message()->set_sender("user" + std::to_string(random() % 32));
+            event->mutable_message()->set_message("hello " + std::to_string(r));
+        }
+    }
+}
+
+static RunResult RunChat(SimulatedCompletionQueue& queue, uint64_t events) {
+
+    RunResult result;
+    ChatRoomService service;
+    SimulatedStreamFactory<OutboundMessage, chatroom::InboundMessage> streams(&queue, ChatClient);
+    auto begin = std::chrono::steady_clock::now();
+    {
+        HandlerRegistry registry;
+        service.BuildAsyncHandlers(&registry, &streams);
+        Serve(registry, queue, events);
+        result.handlers = registry.Size();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::vector<std::string> users;
+    service.ListAllUsers(users);
+    result.members = users.size();
+    result.sessions = service.admission().sessions();
+    return result;
+}
+
+static RunResult RunGreeter(SimulatedCompletionQueue& queue, uint64_t events) {
+
+    RunResult result;
+    MultiGreeterService service;
+    SimulatedStreamFactory<HelloRequest, HelloReply> streams(&queue, GreeterClient);
+    auto begin = std::chrono::steady_clock::now();
+    {
+        HandlerRegistry registry;
+        service.BuildAsyncHandlers(&registry, &streams);
+        Serve(registry, queue, events);
+        result.handlers = registry.Size();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return result;
+}
+
+static RunResult RunRelay(SimulatedCompletionQueue& queue, uint64_t events) {
+
+    RunResult result;
+    ChatRoomService room;
+    ChatRelayService service(&room);
+    SimulatedStreamFactory<RelayBatch, RelayAck> streams(&queue, RelayClient);
+    auto begin = std::chrono::steady_clock::now();
+    {
+        HandlerRegistry registry;
+        service.BuildAsyncHandlers(&registry, &streams);
+        Serve(registry, queue, events);
+        result.handlers = registry.Size();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    // The users of a node are dropped with its last relay call
+    std::vector<std::string> users;
+    room.ListAllUsers(users);
+    result.members = users.size();
+    return result;
+}
+
+static std::vector<std::string> Split(const std::string& list) {
+
+    std::vector<std::string> out;
+    std::istringstream is(list);
+    std::string item;
+    while (std::getline(is, item, ',')) {
+        if (!item.empty()) {
+            out.push_back(item);
+        }
+    }
+    return out;
+}
+
+
+int main(int argc, char** argv) {
+
+    std::map<std::string, std::string> options = {
+        {"services", "chat,greeter,relay"},
+        {"seed", "1"},
+        {"runs", "1"},
+        {"events", "1000000"},
+        {"open-calls", "64"},
+        {"cancel", "0.001"},
+        {"write-fail", "0.001"},
+        {"half-close", "0.01"},
+    };
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos || options.find(arg.substr(0, eq)) == options.end()) {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+        options[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+
+    SimulatedFaults faults;
+    faults.cancel = std::atof(options["cancel"].c_str());
+    faults.writeFail = std::atof(options["write-fail"].c_str());
+    faults.halfClose = std::atof(options["half-close"].c_str());
+    faults.openCalls = std::strtoul(options["open-calls"].c_str(), nullptr, 10);
+    uint64_t seed = std::strtoull(options["seed"].c_str(), nullptr, 10);
+    uint64_t events = std::strtoull(options["events"].c_str(), nullptr, 10);
+    int runs = std::atoi(options["runs"].c_str());
+
+    bool failed = false;
+    std::cout << "[" << std::endl;
+    bool first = true;
+
+    for (const std::string& name : Split(options["services"])) {
+        for (int run = 0; run < runs; run++) {
+
+            SimulatedCompletionQueue queue(seed + run, faults);
+            RunResult result;
+            if (name == "chat") {
+                result = RunChat(queue, events);
+            } else if (name == "greeter") {
+                result = RunGreeter(queue, events);
+            } else if (name == "relay") {
+                result = RunRelay(queue, events);
+            } else {
+                std::cerr << "unknown service " << name << std::endl;
+                return 1;
+            }
+
+            bool leaked = result.handlers != 0 || result.sessions != 0 ||
+                result.members != 0 || queue.streams() != 0;
+            if (leaked || queue.violations() != 0) {
+                failed = true;
+                std::cerr << name << " seed " << seed + run << ": "
+                    << (queue.violations() ? queue.firstViolation() : "leak") << std::endl;
+            }
+
+            std::cout << (first ? "" : ",\n") << "{\"name\": \"" << name << "\""
+                << ", \"seed\": " << seed + run
+                << ", \"events\": " << queue.events()
+                << ", \"calls\": " << queue.calls()
+                << ", \"events_per_sec\": " << static_cast<long>(queue.events() / result.seconds)
+                << ", \"violations\": " << queue.violations()
+                << ", \"leaked_handlers\": " << result.handlers
+                << ", \"leaked_streams\": " << queue.streams()
+                << ", \"leaked_sessions\": " << result.sessions
+                << ", \"leaked_members\": " << result.members
+                << ", \"checksum\": \"" << std::hex << queue.checksum() << std::dec << "\"}";
+            first = false;
+        }
+    }
+    std::cout << "\n]" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+// Load generator used to compare server variants under identical traffic.
+//
+// usage:
+//   load-client chat <address>[,<address>...] [clients] [messages per client] [message size]
+//   load-client greeter <address> [calls] [greetings per call] [concurrency]
+//
+// chat:    every client joins the room and sends its messages, every other
+//          member receives them; reports delivered messages/sec, the
+//          send-to-receive latency and the messages missing from the room
+//          sequence a client saw (gaps). With several addresses (federated
+//          nodes) the clients are spread over them round robin.
+// greeter: runs sayHello calls without pauses; reports greetings/sec.
+
+#include <grpcpp/grpcpp.h>
+
+#include "chatroom.grpc.pb.h"
+#include "hellostreamingworld.grpc.pb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using chatroom::ChatRoom;
+using chatroom::InboundMessage;
+using chatroom::OutboundMessage;
+using hellostreamingworld::HelloReply;
+using hellostreamingworld::HelloRequest;
+using hellostreamingworld::MultiGreeter;
+
+
+static int64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static int64_t Percentile(std::vector<int64_t>& values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+
+static int RunChat(const std::string& address, int clients, int messages, int size) {
+
+    std::vector<std::unique_ptr<ChatRoom::Stub>> stubs;
+    size_t first = 0;
+    while (first <= address.size()) {
+        size_t last = std::min(address.find(',', first), address.size());
+        auto channel = grpc::CreateChannel(address.substr(first, last - first), grpc::InsecureChannelCredentials());
+        stubs.push_back(ChatRoom::NewStub(channel));
+        first = last + 1;
+    }
+
+    typedef grpc::ClientReaderWriter<OutboundMessage, InboundMessage> Stream;
+    std::vector<std::unique_ptr<grpc::ClientContext>> contexts;
+    std::vector<std::unique_ptr<Stream>> streams;
+
+    for (int i = 0; i < clients; i++) {
+        contexts.emplace_back(new grpc::ClientContext());
+        streams.emplace_back(stubs[i % stubs.size()]->chat(contexts.back().get()));
+
+        OutboundMessage reg;
+        reg.mutable_event()->set_username("user" + std::to_string(i));
+        streams.back()->Write(reg);
+
+        InboundMessage welcome;
+        streams.back()->Read(&welcome);
+    }
+
+    std::atomic<long> delivered(0);
+    std::atomic<long> gaps(0);
+    std::mutex latencyMutex;
+    std::vector<int64_t> latencies;
+    std::vector<std::thread> readers;
+
+    for (int i = 0; i < clients; i++) {
+        readers.emplace_back([&, i]() {
+            InboundMessage msg;
+            std::vector<int64_t> local;
+            uint64_t sequence = 0;
+            while (streams[i]->Read(&msg)) {
+                if (msg.sequence() != 0) {
+                    // Numbers of one node are consecutive, acks included
+                    if (sequence != 0 && msg.sequence() > sequence + 1) {
+                        gaps += msg.sequence() - sequence - 1;
+                    }
+                    sequence = msg.sequence();
+                }
+                if (!msg.has_message()) {
+                    continue;
+                }
+                const std::string& text = msg.message().message();
+                local.push_back(NowNanos() - std::atoll(text.c_str()));
+                delivered++;
+            }
+            std::lock_guard<std::mutex> lock(latencyMutex);
+            latencies.insert(latencies.end(), local.begin(), local.end());
+        });
+    }
+
+    int64_t begin = NowNanos();
+
+    std::atomic<long> sent(0);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < clients; i++) {
+        writers.emplace_back([&, i]() {
+            OutboundMessage msg;
+            for (int m = 0; m < messages; m++) {
+                std::string text = std::to_string(NowNanos());
+                text.resize(std::max<size_t>(text.size() + 1, size), ' ');
+                msg.mutable_message()->set_message(text);
+                if (!streams[i]->Write(msg)) {
+                    break;
+                }
+                sent++;
+            }
+        });
+    }
+
+    // Wait until every message is delivered or the traffic stalls,
+    // e.g. when a server stops reading and flow control blocks the writers
+    long expected = static_cast<long>(clients) * (clients - 1) * messages;
+    long lastDelivered = -1;
+    long lastSent = -1;
+    int64_t end = NowNanos();
+    while (delivered < expected && (delivered != lastDelivered || sent != lastSent)) {
+        lastDelivered = delivered;
+        lastSent = sent;
+        end = NowNanos();
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    if (delivered == expected) {
+        end = NowNanos();
+    }
+
+    for (auto& context : contexts) {
+        context->TryCancel();
+    }
+    for (auto& t : writers) {
+        t.join();
+    }
+    for (auto& t : readers) {
+        t.join();
+    }
+    for (auto& stream : streams) {
+        stream->Finish();
+    }
+
+    double seconds = (end - begin) / 1e9;
+    std::cout << "mode=chat clients=" << clients << " messages=" << messages << " size=" << size
+        << " sent=" << sent.load() << " expected=" << expected << " delivered=" << delivered.load()
+        << " gaps=" << gaps.load()
+        << " msgs_per_sec=" << static_cast<long>(delivered / seconds)
+        << " p50_us=" << Percentile(latencies, 0.50) / 1000
+        << " p99_us=" << Percentile(latencies, 0.99) / 1000 << std::endl;
+    return 0;
+}
+
+
+static int RunGreeter(const std::string& address, int calls, int greetings, int concurrency) {
+
+    auto channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+    auto stub = MultiGreeter::NewStub(channel);
+
+    std::atomic<int> next(0);
+    std::atomic<long> received(0);
+    std::mutex latencyMutex;
+    std::vector<int64_t> latencies;
+    std::vector<std::thread> workers;
+
+    int64_t begin = NowNanos();
+
+    for (int w = 0; w < concurrency; w++) {
+        workers.emplace_back([&]() {
+            std::vector<int64_t> local;
+            while (next++ < calls) {
+                HelloRequest request;
+                request.set_name("load");
+                request.set_num_greetings(greetings);
+
+                int64_t start = NowNanos();
+                grpc::ClientContext context;
+                auto reader = stub->sayHello(&context, request);
+                HelloReply reply;
+                while (reader->Read(&reply)) {
+                    received++;
+                }
+                reader->Finish();
+                local.push_back(NowNanos() - start);
+            }
+            std::lock_guard<std::mutex> lock(latencyMutex);
+            latencies.insert(latencies.end(), local.begin(), local.end());
+        });
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    double seconds = (NowNanos() - begin) / 1e9;
+    std::cout << "mode=greeter calls=" << calls << " greetings=" << greetings
+        << " concurrency=" << concurrency << " received=" << received.load()
+        << " greetings_per_sec=" << static_cast<long>(received / seconds)
+        << " call_p50_us=" << Percentile(latencies, 0.50) / 1000
+        << " call_p99_us=" << Percentile(latencies, 0.99) / 1000 << std::endl;
+    return 0;
+}
+
+
+int main(int argc, char** argv) {
+
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " chat|greeter <address> [args...]" << std::endl;
+        return 1;
+    }
+
+    std::string mode(argv[1]);
+    std::string address(argv[2]);
+    int a = argc > 3 ? std::atoi(argv[3]) : 0;
+    int b = argc > 4 ? std::atoi(argv[4]) : 0;
+    int c = argc > 5 ? std::atoi(argv[5]) : 0;
+
+    if (mode == "chat") {
+        return RunChat(address, a > 0 ? a : 10, b > 0 ? b : 1000, c > 0 ? c : 64);
+    }
+    if (mode == "greeter") {
+        return RunGreeter(address, a > 0 ? a : 1000, b > 0 ? b : 10, c > 0 ? c : 8);
+    }
+
+    std::cerr << "unknown mode " << mode << std::endl;
+    return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef SRC_MESSAGE_PIPELINE_H_
+#define SRC_MESSAGE_PIPELINE_H_
+
+#include <string>
+#include <vector>
+
+// One step applied to the text of every chat message before it is broadcast
+struct MessageStageInterface {
+
+    virtual ~MessageStageInterface() {}
+
+    // May rewrite message in place; false drops it
+    virtual bool Process(const std::string& sender, std::string* message) = 0;
+
+};
+
+// Stages run in the order added, on the thread that read the message and
+// outside the room lock. Stages are added before the server starts and must
+// outlive it; they are called concurrently.
+class MessagePipeline {
+public:
+
+    void AddStage(MessageStageInterface* stage) {
+        stages_.push_back(stage);
+    }
+
+    bool empty() const {
+        return stages_.empty();
+    }
+
+    bool Process(const std::string& sender, std::string* message) const {
+        for (auto stage : stages_) {
+            if (!stage->Process(sender, message)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<MessageStageInterface*> stages_;
+};
+
+
+#endif /* SRC_MESSAGE_PIPELINE_H_ */
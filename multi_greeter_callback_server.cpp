@@ -0,0 +1,75 @@
+#include "multi_greeter_callback_service.h"
+#include "server_options.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+
+using grpc::Server;
+using grpc::ServerBuilder;
+
+
+class ServerImpl {
+public:
+
+    explicit ServerImpl(const ServerOptions& options)
+        : options_(options) {
+    }
+
+    ~ServerImpl() {
+        if (!server_) {
+            return;
+        }
+        server_->Shutdown();
+    }
+
+
+    // There is no shutdown handling in this code.
+    // False when the server could not be set up
+    bool Run() {
+        ServerBuilder builder;
+        // Listen on every given address, tcp or unix socket, without any
+        // authentication mechanism.
+        AddListeners(options_, &builder);
+        // Register "service_" as the instance through which we'll communicate with
+        // clients. Reactions are run by gRPC's callback threads, there is no
+        // completion queue to poll.
+        builder.RegisterService(&service_);
+        // Default for every call; streaming calls negotiate their own below
+        builder.SetDefaultCompressionAlgorithm(options_.compression);
+        service_.SetCompressionPolicy(
+            CompressionPolicy(options_.streamCompression, options_.compressionThreshold));
+        // Finally assemble the server.
+        server_ = builder.BuildAndStart();
+        if (!server_) {
+            std::cerr << "Cannot listen on " << FormatAddresses(options_) << std::endl;
+            return false;
+        }
+        std::cout << "Server listening on " << FormatAddresses(options_) << std::endl;
+
+        server_->Wait();
+        return true;
+    }
+
+
+private:
+   ServerOptions options_;
+   MultiGreeterCallbackService service_;
+   std::unique_ptr<Server> server_;
+};
+
+
+
+
+
+int main(int argc, char** argv) {
+
+  ServerOptions options;
+  if (!ParseServerOptions(argc, argv, &options)) {
+    return 1;
+  }
+
+  ServerImpl server(options);
+  return server.Run() ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include "multi_greeter_callback_service.h"
+#include <sstream>
+#include <chrono>
+#include <grpcpp/alarm.h>
+
+
+using namespace std;
+using hellostreamingworld::HelloReply;
+using hellostreamingworld::HelloRequest;
+
+class SayHelloReactor : public grpc::ServerWriteReactor<HelloReply> {
+public:
+    SayHelloReactor(const HelloRequest* request, const CompressionPolicy& compression)
+    : request_(request), compression_(compression), currentReply_(0) {
+        SayHello();
+    }
+
+    virtual void OnWriteDone(bool ok) override {
+
+        if (!ok) {
+            Finish(grpc::Status::CANCELLED);
+            return;
+        }
+
+        if (request_->pauseinmilliseconds() > 0) {
+            alarm_.Set(std::chrono::system_clock::now() + 
+                std::chrono::milliseconds(request_->pauseinmilliseconds()),
+                [this](bool) { SayHello(); });
+        } else {
+            SayHello();
+        }
+    }
+
+    virtual void OnDone() override {
+        delete this;
+    }
+
+private:
+
+    void SayHello() {
+
+        ostringstream os;
+        os << "Hello, " << request_->name() << " (" << ++currentReply_ << ")";
+        reply_.set_message(os.str());
+        grpc::WriteOptions options = compression_.WriteOptionsFor(reply_.ByteSizeLong());
+
+        if (currentReply_ >= request_->num_greetings()) {
+            // We have reached the last reply
+            StartWriteAndFinish(&reply_, options, grpc::Status::OK);
+        } else {
+            StartWrite(&reply_, options);
+        }
+    }
+
+    const HelloRequest* request_;
+    const CompressionPolicy& compression_;
+    HelloReply reply_;
+    int currentReply_;
+    grpc::Alarm alarm_;
+};
+
+
+grpc::ServerWriteReactor<HelloReply>* MultiGreeterCallbackService::sayHello(
+    grpc::CallbackServerContext* context, const HelloRequest* request) {
+    compression_.ApplyToCall(context);
+    return new SayHelloReactor(request, compression_);
+}
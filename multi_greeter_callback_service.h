@@ -0,0 +1,26 @@
+#ifndef SRC_MULTI_GREETER_CALLBACK_SERVICE_H_
+#define SRC_MULTI_GREETER_CALLBACK_SERVICE_H_
+
+#include <grpcpp/grpcpp.h>
+#include "compression_policy.h"
+#include "hellostreamingworld.grpc.pb.h"
+
+using hellostreamingworld::MultiGreeter;
+
+// MultiGreeter implemented with the callback (reactor) API
+class MultiGreeterCallbackService : public MultiGreeter::CallbackService {
+public:
+    virtual grpc::ServerWriteReactor<hellostreamingworld::HelloReply>* sayHello(
+        grpc::CallbackServerContext* context,
+        const hellostreamingworld::HelloRequest* request) override;
+
+    void SetCompressionPolicy(const CompressionPolicy& compression) {
+        compression_ = compression;
+    }
+
+private:
+    CompressionPolicy compression_;
+};
+
+
+#endif /* SRC_MULTI_GREETER_CALLBACK_SERVICE_H_ */
@@ -2,104 +2,125 @@
 #include <sstream>
 #include <memory>
 #include <chrono>
-#include <grpcpp/alarm.h>
+#include "async_method_handler.h"
+#include "async_coroutine_handler.h"
 
 
 using namespace std;
 using hellostreamingworld::HelloReply;
 using hellostreamingworld::HelloRequest;
 
-class SayHelloStreamingHandler : public AsyncCallHandler<SayHelloStreamingHandler> {
+class SayHelloStreamingHandler : public ServerStreamingCallHandler<SayHelloStreamingHandler,
+    MultiGreeterService, ASYNC_METHOD(&MultiGreeterService::RequestsayHello)> {
 public:
     SayHelloStreamingHandler(
         MultiGreeterService* service,
-        grpc::ServerCompletionQueue* cq
+        StreamFactory* streams
         )
-    :cq_(cq), 
-    service_(service), 
-    context_(), 
-    state_(CREATED),
-    writer_(&context_) {
+    : ServerStreamingCallHandler(service, streams),
+    currentReply_(0) {
             
     }
 
-    virtual void Proceed() override {
-
-        if (state_ == CREATED) {
-            // Initial status
-            state_ = PROCESS;
-            // Register async handler for 
-            service_->RequestsayHello(&context_, &request_, &writer_, cq_, cq_, Tag());
-        } else if (state_ == PROCESS) {
-            // Request has been recieved
-            state_ = REPLYING;
-            // Register another instance for new calls
-            registry()->Register(new SayHelloStreamingHandler(service_, cq_));   
-            currentReply_ = 1;
-
-            ostringstream os;
-            os << "Hello, " << request_.name() << " (" << currentReply_++ << ")";
-
-            reply_.set_message(os.str());    
-            if (request_.num_greetings() <= 1) {
-                // Since it is the last reply We are done
-                state_ = FINISHED;
-                writer_.WriteAndFinish(reply_, grpc::WriteOptions(), grpc::Status::OK, Tag());    
-            } else {
-                writer_.Write(reply_, Tag());
-            }
-        } else if (state_ == REPLYING || state_ == TIMER_ELAPSED) {
-            
-            if (state_ == REPLYING && request_.pauseinmilliseconds() > 0) {
-                state_ = TIMER_ELAPSED;
-                alarm_.Set(cq_, std::chrono::system_clock::now() + 
-                    std::chrono::milliseconds(request_.pauseinmilliseconds()), 
-                    Tag());
-                return;
-            }
-            state_ = REPLYING;
-            ostringstream os;
-            os << "Hello, " << request_.name() << " (" << currentReply_++ << ")";
-
-            reply_.set_message(os.str());    
-            if (request_.num_greetings() < currentReply_) {
-                // We have reached the last reply
-                state_ = FINISHED;
-                writer_.WriteAndFinish(reply_, grpc::WriteOptions(), grpc::Status::OK, Tag());    
-            } else {
-                writer_.Write(reply_, Tag());
-            }        
-        } else  {
-            GPR_ASSERT(state_ == FINISHED);
-            Unregister();
+    void OnRequest(const HelloRequest&) {
+        // Request has been recieved, nothing has been sent yet
+        service()->compression().ApplyToCall(&context());
+        SayHello();
+    }
+
+    void OnReady() {
+        // Previous greeting has been written
+        SayHello();
+    }
+
+private:
+
+    void SayHello() {
+
+        if (currentReply_ > 0 && request().pauseinmilliseconds() > 0) {
+            Pause(std::chrono::milliseconds(request().pauseinmilliseconds()));
         }
 
+        ostringstream os;
+        os << "Hello, " << request().name() << " (" << ++currentReply_ << ")";
+
+        reply_.set_message(os.str());
+        Write(reply_, service()->compression().WriteOptionsFor(reply_.ByteSizeLong()));
+
+        if (currentReply_ >= request().num_greetings()) {
+            // We have reached the last reply
+            Finish(grpc::Status::OK);
+        }
     }
 
-    grpc::ServerCompletionQueue* cq_;
-    MultiGreeterService* service_;
-    HelloRequest request_;
     HelloReply reply_;
-    grpc::ServerContext context_;
-    grpc::ServerAsyncWriter<HelloReply> writer_;
-
-    enum State {
-        CREATED = 0,
-        PROCESS = 1,
-        REPLYING = 2,
-        TIMER_ELAPSED = 3,
-        FINISHED = 4
-    };
-
-    State state_;
     int currentReply_;
-    grpc::Alarm alarm_;        
-
 };
 
 
+#ifdef ASYNC_COROUTINES
+
+// Same call as SayHelloStreamingHandler, written as a coroutine
+CallTask SayHelloCoroutine(CoroutineCall& call, MultiGreeterService* service, grpc::ServerCompletionQueue* cq) {
+
+    grpc::ServerContext context;
+    HelloRequest request;
+    grpc::ServerAsyncWriter<HelloReply> writer(&context);
+
+    if (!co_await call.Await([&](void* tag) {
+        service->RequestsayHello(&context, &request, &writer, cq, cq, tag);
+    })) {
+        co_return;  // shutting down
+    }
+
+    // Register another coroutine for new calls
+    call.Spawn(SayHelloCoroutine, service, cq);
+    service->compression().ApplyToCall(&context);
+
+    HelloReply reply;
+    int count = request.num_greetings() > 1 ? request.num_greetings() : 1;
+
+    for (int i = 1; i <= count; i++) {
+
+        if (i > 1 && request.pauseinmilliseconds() > 0 &&
+            !co_await call.Alarm(cq, std::chrono::system_clock::now() +
+                std::chrono::milliseconds(request.pauseinmilliseconds()))) {
+            co_return;
+        }
+
+        ostringstream os;
+        os << "Hello, " << request.name() << " (" << i << ")";
+        reply.set_message(os.str());
+        grpc::WriteOptions options = service->compression().WriteOptionsFor(reply.ByteSizeLong());
+
+        if (i == count) {
+            co_await call.WriteAndFinish(writer, reply, grpc::Status::OK, options);
+        } else if (!co_await call.Write(writer, reply, options)) {
+            // The client is gone
+            co_return;
+        }
+    }
+}
+
+#endif
+
+
 void MultiGreeterService:: BuildAsyncHandlers (
     HandlerRegistry* registry, grpc::ServerCompletionQueue* cq
 ) {
-    registry->Register(new SayHelloStreamingHandler(this, cq));
+#ifdef ASYNC_COROUTINES
+    CoroutineCall::Start(registry, SayHelloCoroutine, this, cq);
+#else
+    GreeterStreamFactory* streams = new GrpcStreamFactory<MultiGreeterService,
+        ASYNC_METHOD(&MultiGreeterService::RequestsayHello)>(this, cq);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streamFactories_.emplace_back(streams);
+    }
+    BuildAsyncHandlers(registry, streams);
+#endif
+}
+
+void MultiGreeterService::BuildAsyncHandlers(HandlerRegistry* registry, GreeterStreamFactory* streams) {
+    registry->Register(new SayHelloStreamingHandler(this, streams));
 }
\ No newline at end of file
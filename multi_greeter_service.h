@@ -1,15 +1,41 @@
 #ifndef SRC_MULTI_GREETER_SERVICE_H_
 #define SRC_MULTI_GREETER_SERVICE_H_
 
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <grpcpp/grpcpp.h>
 #include "async_call_handler.h"
+#include "async_stream.h"
+#include "compression_policy.h"
 #include "hellostreamingworld.grpc.pb.h"
 
 using hellostreamingworld::MultiGreeter;
 
+typedef AsyncStreamFactoryInterface<hellostreamingworld::HelloRequest,
+    hellostreamingworld::HelloReply> GreeterStreamFactory;
+
 class MultiGreeterService : public MultiGreeter::AsyncService {
 public:
     void BuildAsyncHandlers(HandlerRegistry* registry, grpc::ServerCompletionQueue* cq);
+
+    // On streams made by streams, e.g. simulated ones; streams must outlive
+    // the handlers
+    void BuildAsyncHandlers(HandlerRegistry* registry, GreeterStreamFactory* streams);
+
+    void SetCompressionPolicy(const CompressionPolicy& compression) {
+        compression_ = compression;
+    }
+
+    const CompressionPolicy& compression() const {
+        return compression_;
+    }
+
+private:
+    CompressionPolicy compression_;
+    std::mutex mutex_;
+    // One per completion queue
+    std::vector<std::unique_ptr<GreeterStreamFactory>> streamFactories_;
 };
 
 
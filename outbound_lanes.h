@@ -0,0 +1,167 @@
+#ifndef SRC_OUTBOUND_LANES_H_
+#define SRC_OUTBOUND_LANES_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <queue>
+#include "chatroom.pb.h"
+
+// Messages of one stream waiting for the write in flight, in two priority
+// classes. Control messages, everything not written by a user (membership
+// events, server notices, the goodbye), are dequeued before data, so they
+// do not wait behind a client's backlog. Data is whatever carries a room
+// sequence number, chat text and the sender's acks, and keeps its order.
+//
+// After fairnessRatio control messages in a row a waiting data message goes
+// next, a burst of control messages cannot starve the chat. Not thread safe.
+class OutboundLanes {
+public:
+
+    static const int kDefaultFairnessRatio = 8;
+
+    explicit OutboundLanes(int fairnessRatio)
+        : fairnessRatio_(fairnessRatio), controlRun_(0) {
+    }
+
+    static bool IsControl(const chatroom::InboundMessage& msg) {
+        return msg.sequence() == 0;
+    }
+
+    void Push(const std::shared_ptr<chatroom::InboundMessage>& msg) {
+        (IsControl(*msg) ? control_ : data_).push(msg);
+    }
+
+    std::shared_ptr<chatroom::InboundMessage> Pop() {
+
+        bool control = !control_.empty() && (data_.empty() || controlRun_ < fairnessRatio_);
+        std::queue<std::shared_ptr<chatroom::InboundMessage>>& lane = control ? control_ : data_;
+        controlRun_ = control ? controlRun_ + 1 : 0;
+
+        std::shared_ptr<chatroom::InboundMessage> msg = std::move(lane.front());
+        lane.pop();
+        return msg;
+    }
+
+    // Nothing more is written to a client that leaves, its backlog of chat
+    // text would only hold up the goodbye
+    void DropData() {
+        data_ = std::queue<std::shared_ptr<chatroom::InboundMessage>>();
+    }
+
+    bool empty() const {
+        return control_.empty() && data_.empty();
+    }
+
+    size_t size() const {
+        return control_.size() + data_.size();
+    }
+
+private:
+    std::queue<std::shared_ptr<chatroom::InboundMessage>> control_;
+    std::queue<std::shared_ptr<chatroom::InboundMessage>> data_;
+    int fairnessRatio_;
+    int controlRun_;
+};
+
+
+// Restores the room order of the numbered messages posted to one stream.
+// Broadcasts run concurrently, so text n + 1 can be posted before text n;
+// it is held here until n has been delivered. Numbers up to the one the
+// stream joined at are dropped, and until then every numbered message is
+// held. Unnumbered messages pass at once. Not thread safe.
+//
+// The hold is bounded: once kMaxHeld messages wait, or the oldest gap is
+// older than kMaxHoldMs when a message is posted, the missing numbers are
+// given up and the held messages delivered. The client sees the jump and
+// may ask for a resend; a text given up is dropped if it comes later. A
+// room gone quiet posts nothing that would check the deadline, so there the
+// held messages wait until the stalled broadcast arrives.
+class SequenceOrder {
+public:
+
+    // A skipped text is still in the resend history of the room
+    // (ChatRoomData::kResendHistory)
+    static const size_t kMaxHeld = 1024;
+    static const int kMaxHoldMs = 500;
+
+    SequenceOrder()
+        : next_(0) {
+    }
+
+    // The stream is in the room from the text after sequence on
+    template <typename Deliver>
+    void Start(uint64_t sequence, Deliver deliver) {
+        next_ = sequence + 1;
+        if (held_) {
+            held_->messages.erase(held_->messages.begin(), held_->messages.upper_bound(sequence));
+            held_->since = std::chrono::steady_clock::now();
+        }
+        Release(deliver);
+    }
+
+    // Calls deliver for msg, if it is next, and for the held messages that
+    // follow it
+    template <typename Deliver>
+    void Post(const std::shared_ptr<chatroom::InboundMessage>& msg, Deliver deliver) {
+
+        uint64_t sequence = msg->sequence();
+        if (sequence == 0) {
+            deliver(msg);
+        } else if (next_ == 0 || sequence > next_) {
+            if (!held_) {
+                held_.reset(new Held());
+                held_->since = std::chrono::steady_clock::now();
+            }
+            held_->messages.emplace(sequence, msg);
+            // Before the join nothing can be given up
+            bool expired = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - held_->since).count() > kMaxHoldMs;
+            if (next_ != 0 && (held_->messages.size() > kMaxHeld || expired)) {
+                next_ = held_->messages.begin()->first;
+                Release(deliver);
+            }
+        } else if (sequence == next_) {
+            deliver(msg);
+            next_++;
+            Release(deliver);
+        }
+    }
+
+private:
+
+    struct Held {
+        std::map<uint64_t, std::shared_ptr<chatroom::InboundMessage>> messages;
+        // When the stream began to wait for next_
+        std::chrono::steady_clock::time_point since;
+    };
+
+    template <typename Deliver>
+    void Release(Deliver& deliver) {
+
+        if (!held_) {
+            return;
+        }
+        std::map<uint64_t, std::shared_ptr<chatroom::InboundMessage>>& messages = held_->messages;
+        uint64_t first = next_;
+        while (!messages.empty() && messages.begin()->first == next_) {
+            deliver(messages.begin()->second);
+            messages.erase(messages.begin());
+            next_++;
+        }
+        if (messages.empty()) {
+            held_.reset();
+        } else if (next_ != first) {
+            held_->since = std::chrono::steady_clock::now();
+        }
+    }
+
+    uint64_t next_;     // 0 until the stream has joined
+    // Only while out of order, an idle stream keeps a null pointer
+    std::unique_ptr<Held> held_;
+};
+
+
+#endif /* SRC_OUTBOUND_LANES_H_ */
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Starts a federation of chat servers on localhost, every node peered with
+# every other one and sharing a random relay token, and stops them on
+# Ctrl-C. Clients may connect to any node, e.g.
+# load-client chat localhost:50061,localhost:50062,localhost:50063
+#
+# usage: run_federation.sh [build dir] [nodes] [server] [first port]
+
+BUILD=${1:-build}
+NODES=${2:-3}
+SERVER=${3:-chatroom-server}
+PORT=${4:-50061}
+
+LAST=$((PORT + NODES - 1))
+PIDS=
+TOKEN=$(od -An -tx1 -N16 /dev/urandom | tr -d ' \n')
+
+for port in $(seq $PORT $LAST); do
+    peers=
+    for peer in $(seq $PORT $LAST); do
+        if [ $peer -ne $port ]; then
+            peers="$peers${peers:+,}localhost:$peer"
+        fi
+    done
+    "$BUILD/$SERVER" --address=localhost:$port --node=node-$port --peers=$peers --relay-token=$TOKEN &
+    PIDS="$PIDS $!"
+done
+
+trap 'kill $PIDS 2> /dev/null' INT TERM
+wait
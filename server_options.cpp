@@ -0,0 +1,272 @@
+#include "server_options.h"
+#include <grpcpp/grpcpp.h>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+
+static bool ParseAlgorithm(const std::string& value, grpc_compression_algorithm* algorithm) {
+
+    if (value == "none") {
+        *algorithm = GRPC_COMPRESS_NONE;
+        return true;
+    }
+
+    for (int i = 0; i < GRPC_COMPRESS_ALGORITHMS_COUNT; i++) {
+        const char* name = nullptr;
+        grpc_compression_algorithm candidate = static_cast<grpc_compression_algorithm>(i);
+        if (grpc_compression_algorithm_name(candidate, &name) && value == name) {
+            *algorithm = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool ParseLevel(const std::string& value, grpc_compression_level* level) {
+
+    const char* names[] = {"none", "low", "medium", "high"};
+
+    for (int i = 0; i < GRPC_COMPRESS_LEVEL_COUNT; i++) {
+        if (value == names[i]) {
+            *level = static_cast<grpc_compression_level>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool ParsePinning(const std::string& value, CpuPinning* pinning) {
+
+    const char* names[] = {"none", "core", "node"};
+
+    for (int i = 0; i <= PIN_NODE; i++) {
+        if (value == names[i]) {
+            *pinning = static_cast<CpuPinning>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool ParseFilterAction(const std::string& value, FilterAction* action) {
+
+    const char* names[] = {"drop", "mask", "flag"};
+
+    for (int i = 0; i <= FILTER_FLAG; i++) {
+        if (value == names[i]) {
+            *action = static_cast<FilterAction>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool ParsePollMode(const std::string& value, PollMode* mode) {
+
+    const char* names[] = {"block", "spin", "adaptive"};
+
+    for (int i = 0; i <= POLL_ADAPTIVE; i++) {
+        if (value == names[i]) {
+            *mode = static_cast<PollMode>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void PrintUsage(const char* program) {
+    std::cerr << "usage: " << program
+        << " [--address=<host:port>|unix:<path>,...] [--node=<name>] [--peers=<host:port>,...]"
+        << " [--relay-token=<secret>]"
+        << " [--compression=identity|deflate|gzip]"
+        << " [--stream-compression=none|low|medium|high]"
+        << " [--compression-threshold=<bytes>]"
+        << " [--cq-threads=<n>] [--cpus=<list>] [--reserved-cpus=<list>]"
+        << " [--pin=none|core|node] [--poll=block|spin|adaptive] [--spin-us=<us>]"
+        << " [--max-sessions=<n>] [--max-handlers=<n>] [--max-event-lag-ms=<ms>]"
+        << " [--retry-after-ms=<ms>] [--memory-quota=<bytes>] [--fanout-threads=<n>]"
+        << " [--deny-list=<path>] [--filter-action=drop|mask|flag]"
+        << " [--max-concurrent-streams=<n>] [--stream-window=<bytes>]"
+        << " [--keepalive-ms=<ms>] [--keepalive-timeout-ms=<ms>] [--fairness-ratio=<n>]"
+        << " [--read-window=<n>]" << std::endl;
+}
+
+
+bool ParseServerOptions(int argc, char** argv, ServerOptions* options) {
+
+    bool addressGiven = false;
+
+    for (int i = 1; i < argc; i++) {
+
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        bool ok = false;
+
+        if (name == "--address") {
+            // The first one replaces the default
+            if (!addressGiven) {
+                options->addresses.clear();
+                addressGiven = true;
+            }
+            std::istringstream addresses(value);
+            std::string address;
+            while (std::getline(addresses, address, ',')) {
+                if (!address.empty()) {
+                    options->addresses.push_back(address);
+                }
+            }
+            ok = !options->addresses.empty();
+        } else if (name == "--node") {
+            options->node = value;
+            ok = !value.empty();
+        } else if (name == "--peers") {
+            std::istringstream peers(value);
+            std::string peer;
+            while (std::getline(peers, peer, ',')) {
+                if (!peer.empty()) {
+                    options->peers.push_back(peer);
+                }
+            }
+            ok = true;
+        } else if (name == "--relay-token") {
+            options->relayToken = value;
+            ok = !value.empty();
+        } else if (name == "--compression") {
+            ok = ParseAlgorithm(value, &options->compression);
+        } else if (name == "--stream-compression") {
+            ok = ParseLevel(value, &options->streamCompression);
+        } else if (name == "--compression-threshold") {
+            char* end = nullptr;
+            long bytes = std::strtol(value.c_str(), &end, 10);
+            ok = !value.empty() && *end == '\0' && bytes >= 0;
+            options->compressionThreshold = static_cast<size_t>(bytes);
+        } else if (name == "--cq-threads") {
+            char* end = nullptr;
+            long threads = std::strtol(value.c_str(), &end, 10);
+            ok = !value.empty() && *end == '\0' && threads > 0;
+            options->cqThreads = static_cast<int>(threads);
+        } else if (name == "--cpus") {
+            ok = ParseCpuList(value, &options->cpus) && !options->cpus.empty();
+        } else if (name == "--reserved-cpus") {
+            ok = ParseCpuList(value, &options->reservedCpus);
+        } else if (name == "--pin") {
+            ok = ParsePinning(value, &options->pinning);
+        } else if (name == "--poll") {
+            ok = ParsePollMode(value, &options->poll.mode);
+        } else if (name == "--spin-us") {
+            char* end = nullptr;
+            long micros = std::strtol(value.c_str(), &end, 10);
+            ok = !value.empty() && *end == '\0' && micros > 0;
+            options->poll.spin = std::chrono::microseconds(micros);
+        } else if (name == "--deny-list") {
+            options->denyList = value;
+            ok = !value.empty();
+        } else if (name == "--filter-action") {
+            ok = ParseFilterAction(value, &options->filterAction);
+        } else if (name == "--fanout-threads") {
+            char* end = nullptr;
+            long threads = std::strtol(value.c_str(), &end, 10);
+            ok = !value.empty() && *end == '\0' && threads >= 0;
+            options->fanOutThreads = static_cast<int>(threads);
+        } else if (name == "--max-concurrent-streams" || name == "--stream-window" ||
+            name == "--keepalive-ms" || name == "--keepalive-timeout-ms" || name == "--fairness-ratio" ||
+            name == "--read-window") {
+            char* end = nullptr;
+            long number = std::strtol(value.c_str(), &end, 10);
+            ok = !value.empty() && *end == '\0' && number > 0 && number <= INT_MAX;
+            int* field = name == "--max-concurrent-streams" ? &options->maxConcurrentStreams :
+                name == "--stream-window" ? &options->streamWindow :
+                name == "--keepalive-ms" ? &options->keepaliveMs :
+                name == "--keepalive-timeout-ms" ? &options->keepaliveTimeoutMs :
+                name == "--fairness-ratio" ? &options->fairnessRatio : &options->readWindow;
+            *field = static_cast<int>(number);
+        } else if (name == "--max-sessions" || name == "--max-handlers" || name == "--max-event-lag-ms" ||
+            name == "--retry-after-ms" || name == "--memory-quota") {
+            char* end = nullptr;
+            long long number = std::strtoll(value.c_str(), &end, 10);
+            ok = !value.empty() && *end == '\0' && number >= 0;
+            if (name == "--max-sessions") {
+                options->admission.maxSessions = static_cast<int>(number);
+            } else if (name == "--max-handlers") {
+                options->admission.maxHandlers = static_cast<size_t>(number);
+            } else if (name == "--max-event-lag-ms") {
+                options->admission.maxEventLag = std::chrono::milliseconds(number);
+            } else if (name == "--retry-after-ms") {
+                options->admission.retryAfter = std::chrono::milliseconds(number);
+            } else {
+                options->memoryQuota = static_cast<size_t>(number);
+            }
+        }
+
+        if (!ok) {
+            std::cerr << "invalid option " << arg << std::endl;
+            PrintUsage(argv[0]);
+            return false;
+        }
+    }
+
+    if (options->node.empty()) {
+        options->node = options->addresses[0];
+    }
+    return true;
+}
+
+
+void AddListeners(const ServerOptions& options, grpc::ServerBuilder* builder) {
+
+    // Without any authentication mechanism; a unix: socket is open to
+    // whoever may write its path
+    for (auto& address : options.addresses) {
+        builder->AddListeningPort(address, grpc::InsecureServerCredentials());
+    }
+
+    if (options.maxConcurrentStreams > 0) {
+        builder->AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, options.maxConcurrentStreams);
+    }
+    if (options.streamWindow > 0) {
+        // The bandwidth probe would resize it
+        builder->AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, options.streamWindow);
+        builder->AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, 0);
+    }
+    if (options.keepaliveMs > 0) {
+        builder->AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS, options.keepaliveMs);
+        // Chat streams carry no data while the room is quiet, keep pinging
+        // them, and let clients ping as often as the server does
+        builder->AddChannelArgument(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+        builder->AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, options.keepaliveMs);
+    }
+    if (options.keepaliveTimeoutMs > 0) {
+        builder->AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, options.keepaliveTimeoutMs);
+    }
+}
+
+
+std::string FormatAddresses(const ServerOptions& options) {
+
+    std::string list;
+    for (auto& address : options.addresses) {
+        list += (list.empty() ? "" : ", ") + address;
+    }
+    return list;
+}
+
+std::function<void(int)> PlaceFanOutWorkers(std::vector<CpuPlacement> placement) {
+
+    return [placement](int index) {
+        if (static_cast<size_t>(index) < placement.size() && !placement[index].cpus.empty()) {
+            bool ok = ApplyCpuPlacement(placement[index]);
+            std::cout << "Fan-out worker " << index << " on cpus " << FormatCpuList(placement[index].cpus)
+                << (ok ? "" : " failed") << std::endl;
+        }
+    };
+}
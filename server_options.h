@@ -0,0 +1,133 @@
+#ifndef SRC_SERVER_OPTIONS_H_
+#define SRC_SERVER_OPTIONS_H_
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include <grpc/compression.h>
+#include "cpu_affinity.h"
+#include "cq_poller.h"
+#include "admission_control.h"
+#include "content_filter.h"
+
+namespace grpc {
+class ServerBuilder;
+}
+
+// Command line settings shared by the servers, given as --name=value:
+//
+//   --address=<host:port>|unix:<path>         listening address, repeat or
+//                                             comma separate for several
+//   --node=<name>                             federation node name, unique
+//                                             per node (default: the first
+//                                             address)
+//   --peers=<host:port>,...                   every other federation node
+//   --relay-token=<secret>                    shared by the federation nodes,
+//                                             relay calls without it are
+//                                             refused
+//   --compression=identity|deflate|gzip       server default for every call
+//   --stream-compression=none|low|medium|high level negotiated by streaming
+//                                             calls with the client (default
+//                                             none)
+//   --compression-threshold=<bytes>           smaller messages go uncompressed
+//   --cq-threads=<n>                          completion queues, one thread each
+//   --cpus=<list>                             cpus for those threads and the
+//                                             fan-out workers, e.g. 0-3,8
+//                                             (default: the process affinity)
+//   --reserved-cpus=<list>                    cpus left to other services
+//   --pin=none|core|node                      thread per cpu, per NUMA node of
+//                                             the set, or anywhere in the set
+//   --poll=block|spin|adaptive                how the completion queue threads
+//                                             wait: block in Next, spin first
+//                                             for the budget, or spin as long
+//                                             as the event rate suggests
+//   --spin-us=<us>                            spin budget, the cap in adaptive
+//                                             mode (default 50)
+//   --max-sessions=<n>                        chat streams admitted at once
+//   --max-handlers=<n>                        handlers per completion queue
+//   --max-event-lag-ms=<ms>                   shed new chat streams while a
+//                                             completion queue lags this much
+//   --retry-after-ms=<ms>                     retry hint sent when shedding
+//   --memory-quota=<bytes>                    gRPC's ResourceQuota memory bound
+//   --fanout-threads=<n>                      workers fanning out large rooms
+//   --deny-list=<path>                        terms screened out of chat text,
+//                                             one per line, SIGHUP reloads
+//   --filter-action=drop|mask|flag            what a match does (default mask)
+//   --max-concurrent-streams=<n>              streams per HTTP/2 connection
+//   --stream-window=<bytes>                   fixed HTTP/2 stream flow control
+//                                             window (default: sized by gRPC's
+//                                             bandwidth probe)
+//   --keepalive-ms=<ms>                       ping idle connections this often
+//   --keepalive-timeout-ms=<ms>               drop them when a ping is not
+//                                             acknowledged in time
+//   --fairness-ratio=<n>                      control messages a chat stream
+//                                             writes ahead of waiting chat
+//                                             text before one of those
+//                                             (default 8)
+//   --read-window=<n>                         messages a chat stream reads
+//                                             ahead of their processing
+//                                             (default 8)
+struct ServerOptions {
+
+    ServerOptions()
+        : addresses(1, "0.0.0.0:50051"),
+        compression(GRPC_COMPRESS_NONE),
+        streamCompression(GRPC_COMPRESS_LEVEL_NONE),
+        compressionThreshold(256),
+        cqThreads(1),
+        pinning(PIN_NONE),
+        memoryQuota(0),
+        fanOutThreads(0),
+        filterAction(FILTER_MASK),
+        maxConcurrentStreams(0),
+        streamWindow(0),
+        keepaliveMs(0),
+        keepaliveTimeoutMs(0),
+        fairnessRatio(0),
+        readWindow(0) {
+    }
+
+    std::vector<std::string> addresses;
+    std::string node;
+    std::vector<std::string> peers;
+    std::string relayToken;
+    grpc_compression_algorithm compression;
+    grpc_compression_level streamCompression;
+    size_t compressionThreshold;
+    int cqThreads;
+    std::vector<int> cpus;
+    std::vector<int> reservedCpus;
+    CpuPinning pinning;
+    PollSettings poll;
+    AdmissionLimits admission;
+    size_t memoryQuota;
+    int fanOutThreads;
+    std::string denyList;
+    FilterAction filterAction;
+    // 0 keeps the default
+    int maxConcurrentStreams;
+    int streamWindow;
+    int keepaliveMs;
+    int keepaliveTimeoutMs;
+    int fairnessRatio;
+    int readWindow;
+};
+
+// Returns false after printing usage to stderr on an unknown option or value
+bool ParseServerOptions(int argc, char** argv, ServerOptions* options);
+
+// Adds a port for every address and the channel arguments above. With the
+// addresses cleared an embedding program talks to the server over
+// grpc::Server::InProcessChannel only.
+void AddListeners(const ServerOptions& options, grpc::ServerBuilder* builder);
+
+// "a, b" for the startup message
+std::string FormatAddresses(const ServerOptions& options);
+
+// Start of the fan-out workers (SetFanOutThreads): worker i applies
+// placement[i], a slice planned along with the completion queue threads
+std::function<void(int)> PlaceFanOutWorkers(std::vector<CpuPlacement> placement);
+
+
+#endif /* SRC_SERVER_OPTIONS_H_ */
@@ -0,0 +1,242 @@
+#include "simulated_completion_queue.h"
+#include <cstring>
+#include <utility>
+
+
+SimulatedCompletionQueue::Call::Call(SimulatedCompletionQueue* queue)
+    : queue(queue), doneTag(nullptr), openIndex(0), notifyDone(false), accepted(false),
+    finished(false), cancelled(false), halfClosed(false), ended(false), streamAlive(true) {
+    std::memset(inFlight, 0, sizeof(inFlight));
+}
+
+SimulatedCompletionQueue::SimulatedCompletionQueue(uint64_t seed, const SimulatedFaults& faults)
+    : faults_(faults), random_(seed), accepting_(0), streams_(0), events_(0), calls_(0),
+    violations_(0), checksum_(14695981039346656037ULL), shutdown_(false) {
+    if (faults_.openCalls == 0) {
+        faults_.openCalls = 1;
+    }
+}
+
+bool SimulatedCompletionQueue::Next(void** tag, bool* ok) {
+
+    // Admit waiting calls while there is room
+    while (!waiting_.empty() && (shutdown_ || open_.size() + accepting_ < faults_.openCalls)) {
+        size_t i = Pick(waiting_.size());
+        pending_.push_back(std::move(waiting_[i]));
+        waiting_[i] = std::move(waiting_.back());
+        waiting_.pop_back();
+        accepting_++;
+    }
+
+    if (!open_.empty() && (pending_.empty() || Chance(faults_.cancel))) {
+        // A client goes away; when nothing is pending one eventually would
+        Cancel(*open_[Pick(open_.size())]);
+    }
+
+    if (pending_.empty()) {
+        // Shut down and drained, or no handler waits for anything
+        return false;
+    }
+
+    size_t i = Pick(pending_.size());
+    Event event = std::move(pending_[i]);
+    pending_[i] = std::move(pending_.back());
+    pending_.pop_back();
+
+    if (event.op == ACCEPT) {
+        accepting_--;
+    }
+    if (event.op != DONE) {
+        event.call->inFlight[event.op]--;
+    }
+
+    *tag = event.tag;
+    *ok = Complete(event);
+
+    events_++;
+    checksum_ = (checksum_ ^ (reinterpret_cast<uintptr_t>(*tag) * 2 + *ok)) * 1099511628211ULL;
+    return true;
+}
+
+void SimulatedCompletionQueue::Shutdown() {
+
+    shutdown_ = true;
+    while (!open_.empty()) {
+        Cancel(*open_.back());
+    }
+}
+
+void SimulatedCompletionQueue::Start(const std::shared_ptr<Call>& call, Op op, void* tag) {
+
+    Call& c = *call;
+
+    switch (op) {
+    case ACCEPT:
+        if (c.accepted || c.inFlight[ACCEPT] > 0) {
+            Violation("call requested twice");
+        }
+        break;
+    case READ:
+        if (!c.accepted) {
+            Violation("read before the call was accepted");
+        } else if (c.finished) {
+            Violation("read after finish");
+        } else if (c.inFlight[READ] > 0) {
+            Violation("second read in flight");
+        }
+        break;
+    case WRITE:
+    case FINISH:
+        if (!c.accepted) {
+            Violation("write before the call was accepted");
+        } else if (c.finished) {
+            Violation("write after finish");
+        } else if (c.inFlight[WRITE] + c.inFlight[FINISH] > 0) {
+            Violation("second write in flight");
+        }
+        if (op == FINISH) {
+            c.finished = true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    c.inFlight[op]++;
+
+    if (op == FINISH && c.accepted) {
+        // The call is over for the client, the done notification may come
+        // before the finish completes
+        End(c);
+    }
+
+    Event event = { call, op, tag };
+    if (op == ACCEPT && !shutdown_) {
+        waiting_.push_back(std::move(event));
+    } else {
+        if (op == ACCEPT) {
+            accepting_++;
+        }
+        pending_.push_back(std::move(event));
+    }
+}
+
+void SimulatedCompletionQueue::NotifyWhenDone(Call& call, void* tag) {
+
+    if (call.accepted || call.inFlight[ACCEPT] > 0) {
+        Violation("done notification requested after the call");
+    }
+    call.notifyDone = true;
+    call.doneTag = tag;
+}
+
+bool SimulatedCompletionQueue::Complete(const Event& event) {
+
+    Call& call = *event.call;
+
+    if (event.op == DONE) {
+        if (!call.streamAlive) {
+            // gRPC would deliver a tag nobody waits for any more
+            Violation("done notification after the stream was destroyed");
+        }
+        return true;
+    }
+
+    switch (event.op) {
+    case ACCEPT:
+        if (shutdown_ || !call.streamAlive) {
+            return false;
+        }
+        call.accepted = true;
+        call.openIndex = open_.size();
+        open_.push_back(&call);
+        calls_++;
+        call.ClientRequest();
+        return true;
+
+    case READ:
+        if (call.cancelled || call.halfClosed || !call.streamAlive) {
+            return false;
+        }
+        if (Chance(faults_.halfClose)) {
+            call.halfClosed = true;
+            return false;
+        }
+        call.ClientMessage();
+        return true;
+
+    case WRITE:
+        if (call.cancelled) {
+            return false;
+        }
+        if (Chance(faults_.writeFail)) {
+            Cancel(call);
+            return false;
+        }
+        return true;
+
+    case FINISH:
+        return !call.cancelled;
+
+    case ALARM:
+        // Destroying the stream cancels its alarm
+        return call.streamAlive;
+
+    default:
+        return true;
+    }
+}
+
+void SimulatedCompletionQueue::Cancel(Call& call) {
+
+    if (!call.accepted || call.ended) {
+        return;
+    }
+    call.cancelled = true;
+    End(call);
+}
+
+void SimulatedCompletionQueue::End(Call& call) {
+
+    if (call.ended) {
+        return;
+    }
+    call.ended = true;
+
+    open_[call.openIndex] = open_.back();
+    open_[call.openIndex]->openIndex = call.openIndex;
+    open_.pop_back();
+
+    if (call.notifyDone) {
+        Event event = { call.shared_from_this(), DONE, call.doneTag };
+        pending_.push_back(std::move(event));
+    }
+}
+
+void SimulatedCompletionQueue::StreamCreated() {
+    streams_++;
+}
+
+void SimulatedCompletionQueue::StreamDestroyed(Call& call) {
+
+    streams_--;
+    call.streamAlive = false;
+
+    if (call.inFlight[ACCEPT] > 0) {
+        Violation("stream destroyed while waiting for a call");
+    } else if (call.inFlight[READ] > 0) {
+        Violation("stream destroyed with a read in flight");
+    } else if (call.inFlight[WRITE] + call.inFlight[FINISH] > 0) {
+        Violation("stream destroyed with a write in flight");
+    }
+
+    // The server dropped the call without finishing it
+    Cancel(call);
+}
+
+void SimulatedCompletionQueue::Violation(const std::string& what) {
+
+    if (violations_++ == 0) {
+        firstViolation_ = what;
+    }
+}
@@ -0,0 +1,288 @@
+#ifndef SRC_SIMULATED_COMPLETION_QUEUE_H_
+#define SRC_SIMULATED_COMPLETION_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include "async_stream.h"
+
+struct SimulatedFaults {
+
+    SimulatedFaults()
+        : cancel(0), writeFail(0), halfClose(0), openCalls(1) {
+    }
+
+    double cancel;      // per event, a random open call is cancelled
+    double writeFail;   // per write, it fails and the call is cancelled
+    double halfClose;   // per read, the client is done writing
+    size_t openCalls;   // calls accepted at a time, the rest wait
+};
+
+
+// Deterministic stand-in for a server completion queue and the clients of
+// its calls, for driving handlers through HandlerRegistry without a network.
+//
+// Every operation started on a simulated stream becomes a pending event, and
+// Next() delivers one picked at random. Clients are simulated from the same
+// generator: reads are answered by the script of the stream factory, calls
+// are cancelled, writes fail and clients half-close at the fault rates. A
+// seed therefore replays the same interleaving. Alarms fire at once, there
+// is no clock. When nothing is pending the client of a random open call goes
+// away, as one would eventually.
+//
+// The queue checks the rules of AsyncServerStreamInterface and counts each
+// breach as a violation: an operation before the call is accepted or after
+// it finished, a second read or write in flight, and a stream destroyed
+// while an operation other than an alarm is pending, where gRPC would use
+// the call after free. A done notification must be received before its
+// stream is destroyed, and Serve-style loops report completions for tags
+// nobody waits for through Violation(). Single threaded.
+class SimulatedCompletionQueue {
+public:
+
+    enum Op {
+        ACCEPT = 0,
+        READ = 1,
+        WRITE = 2,
+        FINISH = 3,
+        ALARM = 4,
+        DONE = 5
+    };
+
+    // One call as the queue and its client see it; shared by the stream and
+    // its pending events, so an event may outlive the stream
+    struct Call : public std::enable_shared_from_this<Call> {
+
+        explicit Call(SimulatedCompletionQueue* queue);
+
+        virtual ~Call() {}
+
+        // The client fills the request of an accepted call, or the message
+        // a read receives
+        virtual void ClientRequest() = 0;
+        virtual void ClientMessage() = 0;
+
+        SimulatedCompletionQueue* queue;
+        void* doneTag;
+        size_t openIndex;       // slot in open_ while open
+        int inFlight[DONE];
+        bool notifyDone;
+        bool accepted;
+        bool finished;          // a finish has been started
+        bool cancelled;
+        bool halfClosed;
+        bool ended;
+        bool streamAlive;
+    };
+
+    SimulatedCompletionQueue(uint64_t seed, const SimulatedFaults& faults);
+
+    // Like grpc::CompletionQueue::Next, false once shut down and drained
+    bool Next(void** tag, bool* ok);
+
+    // Cancels every call; whatever is pending or started later fails
+    void Shutdown();
+
+    // Operations of the simulated streams
+    void Start(const std::shared_ptr<Call>& call, Op op, void* tag);
+    void NotifyWhenDone(Call& call, void* tag);
+    void Cancel(Call& call);
+    void StreamCreated();
+    void StreamDestroyed(Call& call);
+
+    // Counts a breach found by the caller, e.g. a completion for a handler
+    // that is gone
+    void Violation(const std::string& what);
+
+    std::mt19937_64& random() {
+        return random_;
+    }
+
+    uint64_t events() const {
+        return events_;
+    }
+
+    uint64_t calls() const {
+        return calls_;
+    }
+
+    // Streams not destroyed yet
+    size_t streams() const {
+        return streams_;
+    }
+
+    uint64_t violations() const {
+        return violations_;
+    }
+
+    const std::string& firstViolation() const {
+        return firstViolation_;
+    }
+
+    // Of the delivered (tag, ok) sequence, equal for equal seeds
+    uint64_t checksum() const {
+        return checksum_;
+    }
+
+private:
+
+    struct Event {
+        std::shared_ptr<Call> call;
+        Op op;
+        void* tag;
+    };
+
+    bool Chance(double p) {
+        return p > 0 && static_cast<double>(random_() >> 11) * (1.0 / 9007199254740992.0) < p;
+    }
+
+    size_t Pick(size_t n) {
+        return static_cast<size_t>(random_() % n);
+    }
+
+    bool Complete(const Event& event);
+    void End(Call& call);
+
+    SimulatedFaults faults_;
+    std::mt19937_64 random_;
+    std::vector<Event> pending_;
+    std::vector<Event> waiting_;    // accepts beyond openCalls
+    std::vector<Call*> open_;
+    size_t accepting_;              // accepts among pending_
+    size_t streams_;
+    uint64_t events_;
+    uint64_t calls_;
+    uint64_t violations_;
+    std::string firstViolation_;
+    uint64_t checksum_;
+    bool shutdown_;
+};
+
+
+// Stream of a simulated call, see SimulatedCompletionQueue
+template <typename Request, typename Response>
+class SimulatedStream : public AsyncServerStreamInterface<Request, Response> {
+public:
+
+    typedef std::function<void(Request*, std::mt19937_64&)> ClientScript;
+
+    SimulatedStream(SimulatedCompletionQueue* queue, const ClientScript* script)
+        : queue_(queue), call_(std::make_shared<Call>(queue, script)) {
+        queue_->StreamCreated();
+    }
+
+    ~SimulatedStream() {
+        queue_->StreamDestroyed(*call_);
+    }
+
+    virtual void RequestCall(Request* request, void* tag) override {
+        call_->request = request;
+        queue_->Start(call_, SimulatedCompletionQueue::ACCEPT, tag);
+    }
+
+    virtual void NotifyWhenDone(void* tag) override {
+        queue_->NotifyWhenDone(*call_, tag);
+    }
+
+    virtual void Read(Request* msg, void* tag) override {
+        call_->read = msg;
+        queue_->Start(call_, SimulatedCompletionQueue::READ, tag);
+    }
+
+    virtual void Write(const Response&, grpc::WriteOptions, void* tag) override {
+        queue_->Start(call_, SimulatedCompletionQueue::WRITE, tag);
+    }
+
+    virtual void WriteAndFinish(const Response&, grpc::WriteOptions,
+        const grpc::Status&, void* tag) override {
+        queue_->Start(call_, SimulatedCompletionQueue::FINISH, tag);
+    }
+
+    virtual void Finish(const grpc::Status&, void* tag) override {
+        queue_->Start(call_, SimulatedCompletionQueue::FINISH, tag);
+    }
+
+    virtual void Alarm(std::chrono::system_clock::time_point, void* tag) override {
+        queue_->Start(call_, SimulatedCompletionQueue::ALARM, tag);
+    }
+
+    virtual bool IsCancelled() override {
+        return call_->cancelled;
+    }
+
+    virtual void TryCancel() override {
+        queue_->Cancel(*call_);
+    }
+
+    virtual grpc::ServerContext& context() override {
+        return context_;
+    }
+
+private:
+
+    struct Call : public SimulatedCompletionQueue::Call {
+
+        Call(SimulatedCompletionQueue* queue, const ClientScript* script)
+            : SimulatedCompletionQueue::Call(queue), script(script), request(nullptr), read(nullptr) {
+        }
+
+        virtual void ClientRequest() override {
+            // Bidi calls receive their messages by reading
+            if (request != nullptr) {
+                (*script)(request, queue->random());
+            }
+        }
+
+        virtual void ClientMessage() override {
+            (*script)(read, queue->random());
+        }
+
+        const ClientScript* script;
+        Request* request;
+        Request* read;
+    };
+
+    SimulatedCompletionQueue* queue_;
+    std::shared_ptr<Call> call_;
+    grpc::ServerContext context_;
+};
+
+
+template <typename Request, typename Response>
+class SimulatedStreamFactory : public AsyncStreamFactoryInterface<Request, Response> {
+public:
+
+    // Writes what the client sends next into the message it is given: the
+    // request of a server streaming call, or a message read from a bidi one
+    typedef typename SimulatedStream<Request, Response>::ClientScript ClientScript;
+
+    SimulatedStreamFactory(SimulatedCompletionQueue* queue, ClientScript script)
+        : queue_(queue), script_(std::move(script)) {
+    }
+
+    virtual std::unique_ptr<AsyncServerStreamInterface<Request, Response>> NewStream() override {
+        return std::unique_ptr<AsyncServerStreamInterface<Request, Response>>(
+            new SimulatedStream<Request, Response>(queue_, &script_));
+    }
+
+    virtual AsyncServerStreamInterface<Request, Response>* NewStream(void* storage, size_t size) override {
+        typedef SimulatedStream<Request, Response> Stream;
+        static_assert(alignof(Stream) <= alignof(std::max_align_t), "over-aligned stream");
+        if (size < sizeof(Stream)) {
+            return new Stream(queue_, &script_);
+        }
+        return new (storage) Stream(queue_, &script_);
+    }
+
+private:
+    SimulatedCompletionQueue* queue_;
+    ClientScript script_;
+};
+
+
+#endif /* SRC_SIMULATED_COMPLETION_QUEUE_H_ */
@@ -0,0 +1,147 @@
+#include "trace.h"
+
+#if defined(CHAT_TRACING) || defined(CHAT_TRACING_USDT)
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Records kept per thread; older ones are overwritten
+const size_t kTraceBufferSize = 1 << 16;
+
+struct Record {
+    const char* name;
+    char phase;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t id;
+    uint64_t arg;
+};
+
+struct ThreadBuffer {
+    ThreadBuffer(int tid)
+        : tid(tid), next(0), records(kTraceBufferSize) {
+    }
+
+    int tid;
+    std::atomic<uint64_t> next;
+    std::vector<Record> records;
+};
+
+// Buffers live until exit so that they can be exported after their thread ends
+std::mutex buffersMutex;
+std::vector<ThreadBuffer*> buffers;
+
+std::string dumpPath;
+volatile std::sig_atomic_t dumpRequested = 0;
+
+ThreadBuffer* CurrentBuffer() {
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffer = new ThreadBuffer(static_cast<int>(buffers.size()) + 1);
+        buffers.push_back(buffer);
+    }
+    return buffer;
+}
+
+void OnDumpSignal(int) {
+    dumpRequested = 1;
+}
+
+}
+
+
+uint64_t TraceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void TraceRecord(const char* name, TracePhase phase, uint64_t begin, uint64_t end,
+    uint64_t id, uint64_t arg) {
+
+    ThreadBuffer* buffer = CurrentBuffer();
+    uint64_t index = buffer->next.load(std::memory_order_relaxed);
+    Record& r = buffer->records[index % kTraceBufferSize];
+    r.name = name;
+    r.phase = static_cast<char>(phase);
+    r.begin = begin;
+    r.end = end;
+    r.id = id;
+    r.arg = arg;
+    buffer->next.store(index + 1, std::memory_order_release);
+}
+
+
+void TraceExportChromeJson(std::ostream& out) {
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    bool first = true;
+
+    for (ThreadBuffer* buffer : buffers) {
+
+        uint64_t end = buffer->next.load(std::memory_order_acquire);
+        uint64_t begin = end > kTraceBufferSize ? end - kTraceBufferSize : 0;
+
+        for (uint64_t i = begin; i < end; i++) {
+            const Record& r = buffer->records[i % kTraceBufferSize];
+
+            out << (first ? "\n" : ",\n");
+            first = false;
+
+            // Chrome trace timestamps are microseconds
+            out << "{\"name\": \"" << r.name << "\", \"ph\": \"" << r.phase
+                << "\", \"pid\": 1, \"tid\": " << buffer->tid
+                << ", \"ts\": " << r.begin / 1000.0;
+
+            if (r.phase == TRACE_PHASE_SPAN) {
+                out << ", \"dur\": " << (r.end - r.begin) / 1000.0;
+            } else {
+                out << ", \"cat\": \"chatroom\", \"id\": " << r.id;
+            }
+            out << ", \"args\": {\"id\": " << r.id << ", \"arg\": " << r.arg << "}}";
+        }
+    }
+
+    out << "\n]}\n";
+}
+
+
+bool TraceExportChromeJson(const std::string& path) {
+    std::ofstream out(path.c_str());
+    if (!out) {
+        return false;
+    }
+    TraceExportChromeJson(out);
+    return out.good();
+}
+
+
+void TraceInstallDumpSignal(const std::string& path) {
+
+    dumpPath = path;
+    std::signal(SIGUSR1, OnDumpSignal);
+
+    std::thread([]() {
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (dumpRequested) {
+                dumpRequested = 0;
+                TraceExportChromeJson(dumpPath);
+            }
+        }
+    }).detach();
+}
+
+#endif
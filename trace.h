@@ -0,0 +1,170 @@
+#ifndef SRC_TRACE_H_
+#define SRC_TRACE_H_
+
+// Hot-path trace points, compiled out unless enabled:
+//
+//   CHAT_TRACING=1       record into per-thread ring buffers, exported as
+//                        Chrome trace JSON (chrome://tracing, Perfetto)
+//   CHAT_TRACING_USDT=1  fire USDT probes (provider "chatroom") usable with
+//                        perf, bpftrace or SystemTap; needs <sys/sdt.h>
+//
+// Trace point names are identifiers so they can double as probe names.
+//
+//   TRACE_SCOPE(name, id, arg)       span covering the rest of the scope
+//   TRACE_ASYNC_BEGIN(name, id, arg) start of an operation completed later,
+//   TRACE_ASYNC_END(name, id)        e.g. on the CQ, matched by name and id
+//
+//   TRACE_INSTALL_DUMP_SIGNAL(path)  SIGUSR1 exports the buffers to path
+//
+// id is the handler id where there is one; arg is free form (message
+// address for the fan-out points, so a broadcast can be matched with the
+// writes it started).
+
+#include <cstdint>
+
+#if defined(CHAT_TRACING) || defined(CHAT_TRACING_USDT)
+
+#include <ostream>
+#include <string>
+
+#ifdef CHAT_TRACING_USDT
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#else
+#error "CHAT_TRACING_USDT requires <sys/sdt.h> (systemtap-sdt-dev)"
+#endif
+#endif
+#endif
+
+
+enum TracePhase {
+    TRACE_PHASE_SPAN = 'X',
+    TRACE_PHASE_ASYNC_BEGIN = 'b',
+    TRACE_PHASE_ASYNC_END = 'e'
+};
+
+// Monotonic time in nanoseconds
+uint64_t TraceNow();
+
+// Appends a record to the calling thread's ring buffer
+void TraceRecord(const char* name, TracePhase phase, uint64_t begin, uint64_t end,
+    uint64_t id, uint64_t arg);
+
+// Writes every thread's buffer as Chrome trace JSON. Buffers of threads
+// other than the caller are read without synchronization and may contain a
+// torn record if those threads are still running.
+void TraceExportChromeJson(std::ostream& out);
+
+bool TraceExportChromeJson(const std::string& path);
+
+// Makes SIGUSR1 export the buffers to path. The export runs on a
+// background thread, outside of the signal handler.
+void TraceInstallDumpSignal(const std::string& path);
+
+
+// Span of TRACE_SCOPE: calls enter, and exit at scope exit, the USDT
+// probes; records the span into the ring buffer when name is set
+template <typename Enter, typename Exit>
+class TraceScope {
+public:
+    TraceScope(const char* name, uint64_t id, uint64_t arg, Enter enter, Exit exit)
+        : name_(name), id_(id), arg_(arg), begin_(name ? TraceNow() : 0), exit_(exit),
+        armed_(true) {
+        enter();
+    }
+
+    // Only MakeTraceScope moves one, the source ends without a trace
+    TraceScope(TraceScope&& other)
+        : name_(other.name_), id_(other.id_), arg_(other.arg_), begin_(other.begin_),
+        exit_(other.exit_), armed_(other.armed_) {
+        other.armed_ = false;
+    }
+
+    ~TraceScope() {
+        if (!armed_) {
+            return;
+        }
+        exit_();
+        if (name_) {
+            TraceRecord(name_, TRACE_PHASE_SPAN, begin_, TraceNow(), id_, arg_);
+        }
+    }
+
+private:
+    const char* name_;
+    uint64_t id_;
+    uint64_t arg_;
+    uint64_t begin_;
+    Exit exit_;
+    bool armed_;
+};
+
+// Bound to an auto&& reference, so the scope is not copied at the call site
+template <typename Enter, typename Exit>
+TraceScope<Enter, Exit> MakeTraceScope(const char* name, uint64_t id, uint64_t arg,
+    Enter enter, Exit exit) {
+    return TraceScope<Enter, Exit>(name, id, arg, enter, exit);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#endif
+
+
+#ifdef CHAT_TRACING
+
+#define TRACE_RING_NAME_(name) #name
+#define TRACE_RING_ASYNC_BEGIN_(name, id, arg) \
+    TraceRecord(#name, TRACE_PHASE_ASYNC_BEGIN, TraceNow(), 0, (uint64_t)(id), (uint64_t)(arg))
+#define TRACE_RING_ASYNC_END_(name, id) \
+    TraceRecord(#name, TRACE_PHASE_ASYNC_END, TraceNow(), 0, (uint64_t)(id), 0)
+
+#else
+
+#define TRACE_RING_NAME_(name) nullptr
+#define TRACE_RING_ASYNC_BEGIN_(name, id, arg) ((void)0)
+#define TRACE_RING_ASYNC_END_(name, id) ((void)0)
+
+#endif
+
+
+#ifdef CHAT_TRACING_USDT
+
+#define TRACE_USDT_POINT_(name, id, arg) DTRACE_PROBE2(chatroom, name, (uint64_t)(id), (uint64_t)(arg))
+#define TRACE_USDT_RETURN_(name, id) DTRACE_PROBE1(chatroom, name##_return, (uint64_t)(id))
+
+#else
+
+#define TRACE_USDT_POINT_(name, id, arg) ((void)0)
+#define TRACE_USDT_RETURN_(name, id) ((void)0)
+
+#endif
+
+
+#if defined(CHAT_TRACING) || defined(CHAT_TRACING_USDT)
+
+// Each expands to a single statement, the scope to a single declaration
+#define TRACE_SCOPE(name, id, arg) \
+    auto&& TRACE_CONCAT(traceScope_, __LINE__) = MakeTraceScope(TRACE_RING_NAME_(name), \
+        (uint64_t)(id), (uint64_t)(arg), \
+        [&]() { TRACE_USDT_POINT_(name, id, arg); }, \
+        [&]() { TRACE_USDT_RETURN_(name, id); })
+#define TRACE_ASYNC_BEGIN(name, id, arg) \
+    do { TRACE_RING_ASYNC_BEGIN_(name, id, arg); TRACE_USDT_POINT_(name##_begin, id, arg); } while (0)
+#define TRACE_ASYNC_END(name, id) \
+    do { TRACE_RING_ASYNC_END_(name, id); TRACE_USDT_POINT_(name##_end, id, 0); } while (0)
+#define TRACE_INSTALL_DUMP_SIGNAL(path) TraceInstallDumpSignal(path)
+
+#else
+
+#define TRACE_SCOPE(name, id, arg) ((void)0)
+#define TRACE_ASYNC_BEGIN(name, id, arg) ((void)0)
+#define TRACE_ASYNC_END(name, id) ((void)0)
+#define TRACE_INSTALL_DUMP_SIGNAL(path) ((void)0)
+
+#endif
+
+
+#endif /* SRC_TRACE_H_ */
@@ -0,0 +1,124 @@
+#include "work_stealing_pool.h"
+#include <algorithm>
+#include <utility>
+
+
+WorkStealingPool::WorkStealingPool(int threads, ThreadStart start)
+    : start_(std::move(start)), generation_(0), stopping_(false) {
+
+    for (int i = 0; i <= threads; i++) {
+        queues_.emplace_back(new Queue());
+    }
+    for (int i = 0; i < threads; i++) {
+        workers_.emplace_back(&WorkStealingPool::Run, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void WorkStealingPool::ParallelFor(size_t count, size_t grain,
+    const std::function<void(size_t, size_t)>& body) {
+
+    grain = grain == 0 ? 1 : grain;
+    size_t chunks = (count + grain - 1) / grain;
+
+    if (workers_.empty() || chunks <= 1) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+
+    Job job;
+    job.body = &body;
+    job.pending = chunks;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // Neighbouring chunks go to one queue, so every worker walks a
+        // contiguous part of the range until it has to steal
+        size_t perQueue = (chunks + queues_.size() - 1) / queues_.size();
+        for (size_t c = 0; c < chunks; c++) {
+            Queue& queue = *queues_[c / perQueue];
+            std::lock_guard<std::mutex> queueLock(queue.mutex);
+            queue.chunks.push_back(Chunk{c * grain, std::min(count, (c + 1) * grain), &job});
+        }
+        generation_++;
+    }
+    wake_.notify_all();
+
+    // Chunks of other callers may be run meanwhile, they are as urgent
+    while (TryRunChunk(queues_.size() - 1)) {
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [&job]() { return job.pending == 0; });
+}
+
+void WorkStealingPool::Run(int index) {
+
+    if (start_) {
+        start_(index);
+    }
+
+    unsigned long seen = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]() { return stopping_ || generation_ != seen; });
+            if (stopping_) {
+                return;
+            }
+            seen = generation_;
+        }
+
+        while (TryRunChunk(index)) {
+        }
+    }
+}
+
+bool WorkStealingPool::TryRunChunk(size_t index) {
+
+    Chunk chunk;
+    bool found = false;
+
+    for (size_t i = 0; i < queues_.size() && !found; i++) {
+        Queue& queue = *queues_[(index + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.chunks.empty()) {
+            // Own queue from the front, victims from the back
+            if (i == 0) {
+                chunk = queue.chunks.front();
+                queue.chunks.pop_front();
+            } else {
+                chunk = queue.chunks.back();
+                queue.chunks.pop_back();
+            }
+            found = true;
+        }
+    }
+
+    if (!found) {
+        return false;
+    }
+
+    (*chunk.job->body)(chunk.begin, chunk.end);
+
+    // The job is gone once its caller sees the count drop to 0
+    if (chunk.job->pending.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_.notify_all();
+    }
+    return true;
+}
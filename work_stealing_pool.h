@@ -0,0 +1,78 @@
+#ifndef SRC_WORK_STEALING_POOL_H_
+#define SRC_WORK_STEALING_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool for splitting one large loop over worker threads.
+//
+// ParallelFor deals the chunks of a range out to per-worker queues; every
+// worker runs its own queue front to back and then steals from the back of
+// the others, so a worker slowed down by a few expensive chunks is relieved
+// by the rest. The calling thread works along and returns once every chunk
+// has run. Several threads may call ParallelFor at once: their chunks share
+// the queues, and each caller returns once its own chunks have run.
+class WorkStealingPool {
+public:
+
+    // Run by each worker with its index before it takes any work, e.g. to
+    // pin itself to its cpus
+    typedef std::function<void(int)> ThreadStart;
+
+    explicit WorkStealingPool(int threads, ThreadStart start = ThreadStart());
+
+    ~WorkStealingPool();
+
+    // Runs body(begin, end) for consecutive chunks of at most grain items
+    // covering [0, count)
+    void ParallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+    int threads() const {
+        return static_cast<int>(workers_.size());
+    }
+
+private:
+
+    // One ParallelFor, on the stack of its caller
+    struct Job {
+        const std::function<void(size_t, size_t)>* body;
+        std::atomic<size_t> pending;
+    };
+
+    struct Chunk {
+        size_t begin;
+        size_t end;
+        Job* job;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    void Run(int index);
+
+    // Runs one chunk from queue index or, failing that, from another queue
+    bool TryRunChunk(size_t index);
+
+    // One queue per worker, the last one is the caller's
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    ThreadStart start_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    unsigned long generation_;
+    bool stopping_;
+};
+
+
+#endif /* SRC_WORK_STEALING_POOL_H_ */